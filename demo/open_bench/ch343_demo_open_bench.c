@@ -0,0 +1,218 @@
+/*
+ * ch342/ch343/ch344/ch346/ch347/ch9101/ch9102/ch9103/ch9104/ch9111/ch9114
+ * port open/close latency benchmark
+ *
+ * Copyright (C) 2025 Nanjing Qinheng Microelectronics Co., Ltd.
+ * Web: http://wch.cn
+ * Author: WCH <tech@wch.cn>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License.
+ *
+ * Compile with gcc -O2 -o ch343_demo_open_bench ch343_demo_open_bench.c
+ *
+ * Usage: sudo ./ch343_demo_open_bench /dev/ttyCH343USB0 [count] [baud]
+ *
+ * The port is opened and closed count times (default 200) with the
+ * line settings left unchanged between opens, which is the case the
+ * driver can serve without control transfers. Latencies of open() and
+ * close() are reported separately, together with the driver's shadow
+ * cache counters when they are available in sysfs.
+ *
+ * V1.0 - initial version
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define IOCTL_MAGIC 'W'
+#define IOCTL_CMD_GETCHIPTYPE _IOR(IOCTL_MAGIC, 0x84, uint16_t)
+
+static speed_t baud_to_speed(unsigned int baud)
+{
+	switch (baud) {
+	case 9600:
+		return B9600;
+	case 19200:
+		return B19200;
+	case 38400:
+		return B38400;
+	case 57600:
+		return B57600;
+	case 115200:
+		return B115200;
+	case 230400:
+		return B230400;
+	case 460800:
+		return B460800;
+	case 921600:
+		return B921600;
+	case 1000000:
+		return B1000000;
+	case 2000000:
+		return B2000000;
+	case 3000000:
+		return B3000000;
+	case 4000000:
+		return B4000000;
+	default:
+		return B0;
+	}
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *lat, int count)
+{
+	double sum = 0;
+	int i;
+
+	qsort(lat, count, sizeof(*lat), cmp_double);
+	for (i = 0; i < count; i++)
+		sum += lat[i];
+
+	printf("%-6s min %9.1f  avg %9.1f  p50 %9.1f  p99 %9.1f  max %9.1f us\n",
+	       name, lat[0], sum / count, lat[count / 2],
+	       lat[(count * 99) / 100], lat[count - 1]);
+}
+
+static void show_shadow_stats(const char *devname, const char *when)
+{
+	char path[256], line[128];
+	char *name, *dup;
+	FILE *fp;
+
+	dup = strdup(devname);
+	if (!dup)
+		return;
+	name = basename(dup);
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/device/shadow_stats",
+		 name);
+	free(dup);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+	if (fgets(line, sizeof(line), fp))
+		printf("shadow %s: %s", when, line);
+	fclose(fp);
+}
+
+static int set_baud(int fd, unsigned int baud)
+{
+	struct termios tio;
+	speed_t speed = baud_to_speed(baud);
+
+	if (speed == B0) {
+		printf("unsupported baud rate %u\n", baud);
+		return -1;
+	}
+	if (tcgetattr(fd, &tio))
+		return -1;
+	cfmakeraw(&tio);
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	tio.c_cflag |= CLOCAL | CREAD;
+	/* keep DTR/RTS across close so reopening leaves them untouched */
+	tio.c_cflag &= ~HUPCL;
+
+	return tcsetattr(fd, TCSANOW, &tio);
+}
+
+int main(int argc, char *argv[])
+{
+	double *lat_open, *lat_close;
+	unsigned int baud = 115200;
+	/* the driver stores a 32 bit value, see CHIPTYPE in ch343_lib.h */
+	unsigned int chiptype;
+	int count = 200;
+	double t0, t1, t2;
+	int fd, i;
+
+	if (argc < 2 || argc > 4) {
+		printf("Usage: sudo %s [device] [count] [baud]\n", argv[0]);
+		return -1;
+	}
+	if (argc > 2)
+		count = atoi(argv[2]);
+	if (argc > 3)
+		baud = atoi(argv[3]);
+	if (count <= 0) {
+		printf("count must be positive\n");
+		return -1;
+	}
+
+	lat_open = calloc(count, sizeof(*lat_open));
+	lat_close = calloc(count, sizeof(*lat_close));
+	if (!lat_open || !lat_close) {
+		printf("out of memory\n");
+		return -1;
+	}
+
+	/* settle the line settings once, the loop below keeps them */
+	fd = open(argv[1], O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		printf("open %s error: %s\n", argv[1], strerror(errno));
+		return -1;
+	}
+	if (ioctl(fd, IOCTL_CMD_GETCHIPTYPE, &chiptype) == 0)
+		printf("chip type: %u\n", chiptype);
+	else
+		printf("chip: unknown\n");
+	if (set_baud(fd, baud)) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	show_shadow_stats(argv[1], "before");
+
+	for (i = 0; i < count; i++) {
+		t0 = now_us();
+		fd = open(argv[1], O_RDWR | O_NOCTTY);
+		t1 = now_us();
+		if (fd < 0) {
+			printf("open %s error: %s\n", argv[1],
+			       strerror(errno));
+			return -1;
+		}
+		close(fd);
+		t2 = now_us();
+		lat_open[i] = t1 - t0;
+		lat_close[i] = t2 - t1;
+	}
+
+	show_shadow_stats(argv[1], "after ");
+
+	printf("%d cycles at %u baud\n", count, baud);
+	report("open", lat_open, count);
+	report("close", lat_close, count);
+
+	free(lat_open);
+	free(lat_close);
+
+	return 0;
+}
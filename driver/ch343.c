@@ -40,19 +40,30 @@
 #undef DEBUG
 #undef VERBOSE_DEBUG
 
+#include <linux/anon_inodes.h>
+#include <linux/debugfs.h>
 #include <linux/errno.h>
+#include <linux/hrtimer.h>
 #include <linux/idr.h>
 #include <linux/init.h>
+#include <linux/jump_label.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/poll.h>
+#if IS_ENABLED(CONFIG_PPS)
+#include <linux/pps_kernel.h>
+#endif
 #include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/serial.h>
 #include <linux/slab.h>
 #include <linux/tty.h>
 #include <linux/tty_driver.h>
 #include <linux/tty_flip.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/usb/cdc.h>
@@ -82,6 +93,16 @@
 #define IOCTL_CMD_GETUARTINDEX _IOR(IOCTL_MAGIC, 0x85, u16)
 #define IOCTL_CMD_CTRLIN _IOWR(IOCTL_MAGIC, 0x90, u16)
 #define IOCTL_CMD_CTRLOUT _IOW(IOCTL_MAGIC, 0x91, u16)
+#define IOCTL_CMD_SETTXRATE _IOW(IOCTL_MAGIC, 0x92, struct ch343_txrate)
+#define IOCTL_CMD_GETTXRATE _IOR(IOCTL_MAGIC, 0x93, struct ch343_txrate)
+#define IOCTL_CMD_TXTSOPEN _IO(IOCTL_MAGIC, 0x94)
+#define IOCTL_CMD_CTRLSYNC _IO(IOCTL_MAGIC, 0x95)
+#define IOCTL_CMD_REGREAD _IOWR(IOCTL_MAGIC, 0x96, struct ch343_regio)
+#define IOCTL_CMD_REGWRITE _IOW(IOCTL_MAGIC, 0x97, struct ch343_regio)
+#define IOCTL_CMD_MODEMSEQ _IOWR(IOCTL_MAGIC, 0x98, struct ch343_modemseq)
+#define IOCTL_CMD_BREAKFRAME _IOWR(IOCTL_MAGIC, 0x99, struct ch343_breakframe)
+#define IOCTL_CMD_GETAUTOBAUD _IOR(IOCTL_MAGIC, 0x9A, u32)
+#define IOCTL_CMD_MEVOPEN _IO(IOCTL_MAGIC, 0x9B)
 
 #ifndef USB_DEVICE_INTERFACE_NUMBER
 #define USB_DEVICE_INTERFACE_NUMBER(vend, prod, num)   \
@@ -93,6 +114,21 @@
 
 static struct usb_driver ch343_driver;
 static struct tty_driver *ch343_tty_driver;
+static struct dentry *ch343_debugfs_root;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0))
+#define CH343_TRACE
+/* one key per CH343_TR_* part, any is held by each part enabled */
+static DEFINE_STATIC_KEY_FALSE(ch343_tr_any);
+static DEFINE_STATIC_KEY_FALSE(ch343_tr_stats);
+static DEFINE_STATIC_KEY_FALSE(ch343_tr_stamps);
+static DEFINE_STATIC_KEY_FALSE(ch343_tr_payload);
+static DEFINE_STATIC_KEY_FALSE(ch343_tr_hist);
+static DEFINE_MUTEX(ch343_tr_mutex);
+#define ch343_traced(part) static_branch_unlikely(&ch343_tr_##part)
+#else
+#define ch343_traced(part) false
+#endif
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0))
 static DEFINE_IDR(ch343_minors);
@@ -213,1534 +249,4903 @@ static void ch343_release_minor(struct ch343 *ch343)
 
 #endif
 
-static int ch343_control_out(struct ch343 *ch343, u8 request, u16 value,
-			     u16 index)
+static inline void ch343_hrtimer_init(struct hrtimer *timer,
+				      enum hrtimer_restart (*fn)(struct hrtimer *))
 {
-	int retval;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+	hrtimer_setup(timer, fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	timer->function = fn;
+#endif
+}
 
-	retval = usb_autopm_get_interface(ch343->control);
-	if (retval)
-		return retval;
-	retval = usb_control_msg(
-		ch343->dev, usb_sndctrlpipe(ch343->dev, 0), request,
-		USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_OUT, value,
-		index, NULL, 0, DEFAULT_TIMEOUT);
-	usb_autopm_put_interface(ch343->control);
+static int ch343_status_refresh(struct ch343 *ch343);
 
-	return retval;
+/*
+ * Record queues delivered to userspace through an anonymous fd. A queue
+ * has one reader, records are pushed from completion context and dropped
+ * with accounting when the reader falls behind.
+ */
+static void ch343_evq_init(struct ch343_evq *q, struct ch343 *ch343,
+			   unsigned int recsize)
+{
+	spin_lock_init(&q->lock);
+	init_waitqueue_head(&q->wait);
+	q->recsize = recsize;
+	q->instance = ch343;
 }
 
-static int ch343_control_in(struct ch343 *ch343, u8 request, u16 value,
-			    u16 index, char *buf, unsigned bufsize)
+/* Returns false if the record was dropped on a full queue. */
+static bool ch343_evq_push(struct ch343_evq *q, const void *rec)
 {
-	int retval;
+	unsigned long flags;
+	bool queued = false;
 
-	retval = usb_autopm_get_interface(ch343->control);
-	if (retval)
-		return retval;
-	retval = usb_control_msg(
-		ch343->dev, usb_rcvctrlpipe(ch343->dev, 0), request,
-		USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_IN, value,
-		index, buf, bufsize, DEFAULT_TIMEOUT);
-	usb_autopm_put_interface(ch343->control);
+	spin_lock_irqsave(&q->lock, flags);
+	if (!q->open) {
+		spin_unlock_irqrestore(&q->lock, flags);
+		return true;
+	}
+	if (q->head - q->tail < q->len) {
+		memcpy(q->buf + (q->head & (q->len - 1)) * q->recsize, rec,
+		       q->recsize);
+		q->head++;
+		queued = true;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
 
-	return retval;
+	wake_up_interruptible(&q->wait);
+
+	return queued;
 }
 
-static int ch343_control_msg_out(struct ch343 *ch343, u8 request,
-				 u8 requesttype, u16 value, u16 index,
-				 void *buf, unsigned bufsize)
+static ssize_t ch343_evq_read(struct file *file, char __user *buf,
+			      size_t count, loff_t *ppos)
 {
-	int retval;
-	char *buffer;
+	struct ch343_evq *q = file->private_data;
+	struct ch343 *ch343 = q->instance;
+	char *rec;
+	size_t done = 0;
+	ssize_t rv = 0;
 
-	buffer = kmalloc(bufsize, GFP_KERNEL);
-	if (!buffer)
+	if (count < q->recsize)
+		return -EINVAL;
+
+	rec = kmalloc(q->recsize, GFP_KERNEL);
+	if (!rec)
 		return -ENOMEM;
 
-	retval = copy_from_user(buffer, (char __user *)buf, bufsize);
-	if (retval)
-		goto out;
+	while (done + q->recsize <= count) {
+		spin_lock_irq(&q->lock);
+		if (q->head == q->tail) {
+			spin_unlock_irq(&q->lock);
+			if (done || ch343->disconnected)
+				break;
+			if (file->f_flags & O_NONBLOCK) {
+				rv = -EAGAIN;
+				break;
+			}
+			rv = wait_event_interruptible(
+				q->wait,
+				q->head != q->tail || ch343->disconnected);
+			if (rv)
+				break;
+			continue;
+		}
+		memcpy(rec, q->buf + (q->tail & (q->len - 1)) * q->recsize,
+		       q->recsize);
+		q->tail++;
+		spin_unlock_irq(&q->lock);
 
-	retval = usb_autopm_get_interface(ch343->control);
-	if (retval)
-		goto out;
-	retval = usb_control_msg(ch343->dev,
-				 usb_sndctrlpipe(ch343->dev, 0), request,
-				 requesttype, value, index, buffer,
-				 bufsize, DEFAULT_TIMEOUT);
-	usb_autopm_put_interface(ch343->control);
+		if (copy_to_user(buf + done, rec, q->recsize)) {
+			rv = -EFAULT;
+			break;
+		}
+		done += q->recsize;
+	}
 
-out:
-	kfree(buffer);
-	return retval;
+	kfree(rec);
+	return done ? done : rv;
 }
 
-static int ch343_control_msg_in(struct ch343 *ch343, u8 request,
-				u8 requesttype, u16 value, u16 index,
-				void *buf, unsigned bufsize)
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0))
+static __poll_t ch343_evq_poll(struct file *file, poll_table *wait)
+#else
+static unsigned int ch343_evq_poll(struct file *file, poll_table *wait)
+#endif
 {
-	int retval;
-	char *buffer;
+	struct ch343_evq *q = file->private_data;
+	unsigned int mask = 0;
 
-	buffer = kmalloc(bufsize, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	poll_wait(file, &q->wait, wait);
 
-	retval = usb_autopm_get_interface(ch343->control);
-	if (retval)
-		goto out;
-	retval = usb_control_msg(ch343->dev,
-				 usb_rcvctrlpipe(ch343->dev, 0), request,
-				 requesttype, value, index, buffer,
-				 bufsize, DEFAULT_TIMEOUT);
-	if (retval > 0) {
-		if (copy_to_user((char __user *)buf, buffer, retval)) {
-			retval = -EFAULT;
-		}
-	}
-	usb_autopm_put_interface(ch343->control);
+	spin_lock_irq(&q->lock);
+	if (q->head != q->tail)
+		mask |= POLLIN | POLLRDNORM;
+	spin_unlock_irq(&q->lock);
+	if (q->instance->disconnected)
+		mask |= POLLHUP;
 
-out:
-	kfree(buffer);
-	return retval;
+	return mask;
 }
 
-static inline int ch343_set_control(struct ch343 *ch343, int control)
+static int ch343_evq_release(struct inode *inode, struct file *file)
 {
-	if (ch343->iface <= 1)
-		return ch343_control_out(ch343, CMD_C2 + ch343->iface,
-					 ~control, 0x0000);
-	else if (ch343->iface <= 3)
-		return ch343_control_out(
-			ch343, CMD_C2 + 0x10 + (ch343->iface - 2),
-			~control, 0x0000);
-	else
-		return -1;
-}
+	struct ch343_evq *q = file->private_data;
+	struct ch343 *ch343 = q->instance;
+	void *buf;
+
+	spin_lock_irq(&q->lock);
+	q->open = false;
+	buf = q->buf;
+	q->buf = NULL;
+	spin_unlock_irq(&q->lock);
+
+	kfree(buf);
+	/* the modem event reader may have been the last status consumer */
+	if (q == &ch343->mev) {
+		mutex_lock(&ch343->mutex);
+		ch343_status_refresh(ch343);
+		mutex_unlock(&ch343->mutex);
+	}
+	tty_port_put(&ch343->port);
 
-static inline int ch343_set_line(struct ch343 *ch343,
-				 struct usb_cdc_line_coding *line)
-{
 	return 0;
 }
 
-static int ch343_configure(struct ch343 *ch343)
+static const struct file_operations ch343_evq_fops = {
+	.owner = THIS_MODULE,
+	.read = ch343_evq_read,
+	.poll = ch343_evq_poll,
+	.release = ch343_evq_release,
+};
+
+/*
+ * Start recording into q and return a new fd to read it from.
+ */
+static int ch343_evq_getfd(struct ch343_evq *q, const char *name,
+			   unsigned int len)
 {
-	char *buffer;
-	int r;
-	const unsigned size = 8;
-	u8 chiptype;
-	u8 chipver;
+	struct ch343 *ch343 = q->instance;
+	void *buf;
+	int fd;
 
-	buffer = kmalloc(size, GFP_KERNEL);
-	if (!buffer)
+	buf = kcalloc(len, q->recsize, GFP_KERNEL);
+	if (!buf)
 		return -ENOMEM;
 
-	r = ch343_control_in(ch343, CMD_C6, 0, 0, buffer, size);
-	if (r <= 0)
-		goto out;
-
-	chipver = buffer[0];
-	chiptype = buffer[1];
-	ch343->iosupport = true;
-
-	switch (ch343->idProduct) {
-	case 0x55D2:
-		ch343->num_ports = 2;
-		if (chiptype == 0x41)
-			ch343->chiptype = CHIP_CH342K;
-		else
-			ch343->chiptype = CHIP_CH342F;
-		if (chiptype != 0x48 || chipver < 0x45)
-			ch343->iosupport = false;
-		break;
-	case 0x55D3:
-		ch343->num_ports = 1;
-		if (chiptype == 0x02)
-			ch343->chiptype = CHIP_CH343J;
-		else if (chiptype == 0x01)
-			ch343->chiptype = CHIP_CH343K;
-		else if (chiptype == 0x18)
-			ch343->chiptype = CHIP_CH343G_AUTOBAUD;
-		else
-			ch343->chiptype = CHIP_CH343GP;
-		ch343->iosupport = false;
-		break;
-	case 0x55D4:
-		ch343->num_ports = 1;
-		if (chiptype == 0x09)
-			ch343->chiptype = CHIP_CH9102X;
-		else
-			ch343->chiptype = CHIP_CH9102F;
-		break;
-	case 0x55D5:
-		ch343->num_ports = 4;
-		if (chiptype == 0xC0) {
-			if ((buffer[0] & 0xF0) == 0x40)
-				ch343->chiptype = CHIP_CH344L;
-			else
-				ch343->chiptype = CHIP_CH344L_V2;
-		} else
-			ch343->chiptype = CHIP_CH344Q;
-		break;
-	case 0x55D7:
-		ch343->num_ports = 2;
-		ch343->chiptype = CHIP_CH9103M;
-		break;
-	case 0x55D8:
-		ch343->num_ports = 1;
-		if (chiptype == 0x0A)
-			ch343->chiptype = CHIP_CH9101RY;
-		else
-			ch343->chiptype = CHIP_CH9101UH;
-		break;
-	case 0x55DB:
-	case 0x55DD:
-		ch343->num_ports = 1;
-		ch343->chiptype = CHIP_CH347TF;
-		break;
-	case 0x55DA:
-	case 0x55DE:
-		ch343->num_ports = 2;
-		ch343->chiptype = CHIP_CH347TF;
-		break;
-	case 0x55E7:
-		ch343->num_ports = 1;
-		ch343->chiptype = CHIP_CH339W;
-		ch343->iosupport = false;
-		break;
-	case 0x55DF:
-		ch343->num_ports = 4;
-		ch343->chiptype = CHIP_CH9104L;
-		break;
-	case 0x55E9:
-		ch343->num_ports = 1;
-		ch343->chiptype = CHIP_CH9111L_M0;
-		break;
-	case 0x55EA:
-		ch343->num_ports = 1;
-		ch343->chiptype = CHIP_CH9111L_M1;
-		break;
-	case 0x55E8:
-		ch343->num_ports = 4;
-		chiptype = buffer[2];
-		if (chiptype == 0x48)
-			ch343->chiptype = CHIP_CH9114L;
-		else if (chiptype == 0x49)
-			ch343->chiptype = CHIP_CH9114W;
-		else if (chiptype == 0x4A)
-			ch343->chiptype = CHIP_CH9114F;
-		break;
-	case 0x55EB:
-		ch343->num_ports = 1;
-		if (buffer[4] & 0x01)
-			ch343->chiptype = CHIP_CH346C_M1;
-		else
-			ch343->chiptype = CHIP_CH346C_M0;
-		break;
-	case 0x55EC:
-		ch343->num_ports = 2;
-		ch343->chiptype = CHIP_CH346C_M2;
-		break;
-	default:
-		break;
+	spin_lock_irq(&q->lock);
+	if (q->open) {
+		spin_unlock_irq(&q->lock);
+		kfree(buf);
+		return -EBUSY;
+	}
+	q->buf = buf;
+	q->len = len;
+	q->head = 0;
+	q->tail = 0;
+	/* a new reader does not see the losses of the previous one */
+	if (q == &ch343->txts) {
+		ch343->txts_lost = 0;
+	} else if (q == &ch343->mev) {
+		ch343->mev_seq = 0;
+		ch343->mev_lost = 0;
+	}
+	q->open = true;
+	spin_unlock_irq(&q->lock);
+
+	tty_port_get(&ch343->port);
+	fd = anon_inode_getfd(name, &ch343_evq_fops, q, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		spin_lock_irq(&q->lock);
+		q->open = false;
+		q->buf = NULL;
+		spin_unlock_irq(&q->lock);
+		kfree(buf);
+		tty_port_put(&ch343->port);
 	}
 
-out:
-	kfree(buffer);
-	return r < 0 ? r : 0;
+	return fd;
 }
 
-static int ch343_wb_alloc(struct ch343 *ch343)
+/*
+ * Vendor control requests go through a per-port queue of preallocated
+ * urbs so that callers which do not need the result are not blocked for
+ * a control round trip. Requests of a port reach the device in the order
+ * they were queued. The queue is protected by write_lock, which also
+ * guards susp_count: nothing is submitted while the interface is
+ * suspended and ch343_resume() restarts the queue.
+ */
+static void ch343_cr_kick(struct ch343 *ch343);
+static int ch343_wb_alloc(struct ch343 *ch343);
+static int ch343_start_wb(struct ch343 *ch343, struct ch343_wb *wb);
+static int ch343_autobaud_poll(struct ch343 *ch343);
+static u64 ch343_tx_drain_ns(struct ch343 *ch343, unsigned int bytes);
+
+static void ch343_regs_invalidate(struct ch343_chip *chip)
 {
-	int i, wbn;
-	struct ch343_wb *wb;
+	unsigned long flags;
 
-	wbn = 0;
-	i = 0;
-	for (;;) {
-		wb = &ch343->wb[wbn];
-		if (!wb->use) {
-			wb->use = 1;
-			return wbn;
-		}
-		wbn = (wbn + 1) % CH343_NW;
-		if (++i >= CH343_NW)
-			return -1;
-	}
+	spin_lock_irqsave(&chip->reg_lock, flags);
+	bitmap_zero(chip->reg_valid, CH343_NREGS);
+	chip->reg_gen++;
+	spin_unlock_irqrestore(&chip->reg_lock, flags);
 }
 
-static int ch343_wb_is_avail(struct ch343 *ch343)
+/*
+ * Forget all device state the driver mirrors, called with write_lock
+ * held.
+ */
+static void ch343_shadow_invalidate(struct ch343 *ch343)
 {
-	int i, n;
-	unsigned long flags;
+	int i;
 
-	n = CH343_NW;
-	spin_lock_irqsave(&ch343->write_lock, flags);
-	for (i = 0; i < CH343_NW; i++)
-		n -= ch343->wb[i].use;
-	spin_unlock_irqrestore(&ch343->write_lock, flags);
-	return n;
+	for (i = 0; i < CH343_SH_NUM; i++)
+		ch343->shadow[i].valid = false;
+	ch343_regs_invalidate(ch343->chip);
 }
 
-static void ch343_write_done(struct ch343 *ch343, struct ch343_wb *wb)
+static void ch343_cr_finish(struct ch343 *ch343, struct ch343_cr *cr)
 {
-	wb->use = 0;
-	ch343->transmitting--;
-	usb_autopm_put_interface_async(ch343->control);
+	/* writes held back by the barrier may go on */
+	if (cr->barrier && !--ch343->cr_barriers)
+		schedule_work(&ch343->work);
+	cr->barrier = false;
+	if (cr->shadow && cr->status < 0)
+		cr->shadow->valid = false;
+	cr->shadow = NULL;
+	if (cr->pm)
+		usb_autopm_put_interface_async(ch343->control);
+	cr->pm = false;
+	if (cr->complete)
+		cr->complete(ch343, cr);
+	if (cr->waited) {
+		complete(&cr->done);
+	} else {
+		list_add_tail(&cr->list, &ch343->cr_free);
+		wake_up(&ch343->cr_wait);
+	}
 }
 
-static int ch343_start_wb(struct ch343 *ch343, struct ch343_wb *wb)
+/*
+ * Drop the cached registers a vendor OUT request can change. Modem
+ * output updates only show in the status registers, which are never
+ * cached. Port 0 line coding and break use the layout shared with the
+ * CH341: the divisor at 0x12/0x13, line control at 0x18/0x25 and break
+ * control at 0x05. The register banks behind other ports and the clock
+ * requests are not documented, so those drop the whole cache.
+ */
+static const u8 ch343_line_regs[] = { 0x12, 0x13, 0x18, 0x25 };
+static const u8 ch343_break_regs[] = { 0x05, 0x18 };
+
+static void ch343_regs_touched(struct ch343 *ch343, u8 request)
 {
-	int rc;
+	struct ch343_chip *chip = ch343->chip;
+	const u8 *regs;
+	unsigned long flags;
+	int i, n;
 
-	ch343->transmitting++;
+	switch (request) {
+	case CMD_W:
+		/* ch343_regs_write() keeps the cache up to date */
+		return;
+	case CMD_C2:
+	case CMD_C2 + 1:
+	case CMD_C2 + 0x10:
+	case CMD_C2 + 0x11:
+		return;
+	case CMD_C1:
+		regs = ch343_line_regs;
+		n = ARRAY_SIZE(ch343_line_regs);
+		break;
+	case CMD_C4:
+		/* the same request reaches the other ports' banks */
+		if (ch343->iface) {
+			ch343_regs_invalidate(chip);
+			return;
+		}
+		regs = ch343_break_regs;
+		n = ARRAY_SIZE(ch343_break_regs);
+		break;
+	default:
+		ch343_regs_invalidate(chip);
+		return;
+	}
 
-	wb->urb->transfer_buffer = wb->buf;
-	wb->urb->transfer_dma = wb->dmah;
-	wb->urb->transfer_buffer_length = wb->len;
-	wb->urb->dev = ch343->dev;
+	spin_lock_irqsave(&chip->reg_lock, flags);
+	for (i = 0; i < n; i++)
+		clear_bit(regs[i], chip->reg_valid);
+	/* a read in progress must not store a value from before */
+	chip->reg_gen++;
+	spin_unlock_irqrestore(&chip->reg_lock, flags);
+}
 
-	rc = usb_submit_urb(wb->urb, GFP_ATOMIC);
-	if (rc < 0) {
-		dev_err(&ch343->data->dev,
-			"%s - usb_submit_urb(write bulk) failed: %d\n",
-			__func__, rc);
-		ch343_write_done(ch343, wb);
+static int ch343_cr_class(u8 request)
+{
+	switch (request) {
+	case CMD_C1:
+	case CMD_C1 + 1:
+	case CMD_C1 + 0x10:
+	case CMD_C1 + 0x11:
+		return CH343_CRS_LINE;
+	case CMD_C2:
+	case CMD_C2 + 1:
+	case CMD_C2 + 0x10:
+	case CMD_C2 + 0x11:
+		return CH343_CRS_MODEM;
+	case CMD_C4:
+		return CH343_CRS_BREAK;
+	case CMD_C6:
+		return CH343_CRS_CHIP;
+	case CMD_C7:
+	case CMD_C8:
+		return CH343_CRS_CLOCK;
+	case CMD_R:
+	case CMD_W:
+		return CH343_CRS_REG;
+	default:
+		return CH343_CRS_OTHER;
 	}
-	return rc;
 }
 
-static void ch343_update_status(struct ch343 *ch343, unsigned char *data,
-				size_t len)
+/* Called with write_lock held. */
+static void ch343_cr_account(struct ch343 *ch343, struct ch343_cr *cr)
 {
-	unsigned long flags;
-	u8 status;
-	u8 difference;
-	u8 type = data[0];
-	u8 handled = 0;
+	struct ch343_cr_stats *st;
+	u32 us, wait_us, total_us;
+	ktime_t now = ktime_get();
+
+	st = &ch343->cr_stats[ch343_cr_class(cr->dr->bRequest)];
+	us = (u32)ktime_us_delta(now, cr->submit);
+	wait_us = (u32)ktime_us_delta(cr->submit, cr->requested);
+	total_us = (u32)ktime_us_delta(now, cr->requested);
+
+	st->count++;
+	if (cr->timedout)
+		st->timeouts++;
+	else if (cr->urb->status)
+		st->errors++;
+	st->sum_us += us;
+	if (st->count == 1 || us < st->min_us)
+		st->min_us = us;
+	if (us > st->max_us)
+		st->max_us = us;
+	st->hist[min(fls(us), CH343_CRS_BUCKETS - 1)]++;
+	st->wait_sum_us += wait_us;
+	if (wait_us > st->wait_max_us)
+		st->wait_max_us = wait_us;
+	st->total_sum_us += total_us;
+	if (total_us > st->total_max_us)
+		st->total_max_us = total_us;
+}
 
-	if (len < 4)
-		return;
+static void ch343_cr_callback(struct urb *urb)
+{
+	struct ch343_cr *cr = urb->context;
+	struct ch343 *ch343 = cr->instance;
+	unsigned long flags;
 
-	if (ch343->chiptype == CHIP_CH344L) {
-		if (data[0] != 0x00)
-			return;
-		type = data[1];
-	} else if (ch343->chiptype == CHIP_CH346C_M0 ||
-		   ch343->chiptype == CHIP_CH346C_M1 ||
-		   ch343->chiptype == CHIP_CH346C_M2 ||
-		   ch343->chiptype == CHIP_CH339W ||
-		   ch343->chiptype == CHIP_CH347TF ||
-		   ch343->chiptype == CHIP_CH344Q ||
-		   ch343->chiptype == CHIP_CH344L_V2 ||
-		   ch343->chiptype == CHIP_CH9104L ||
-		   ch343->chiptype == CHIP_CH9114L ||
-		   ch343->chiptype == CHIP_CH9114F ||
-		   ch343->chiptype == CHIP_CH9114W ||
-		   ch343->chiptype == CHIP_CH9111L_M0 ||
-		   ch343->chiptype == CHIP_CH9111L_M1) {
-		type = data[1];
-	}
+	if (urb->status)
+		dev_dbg(&ch343->control->dev,
+			"%s - request 0x%02x failed: %d\n", __func__,
+			cr->dr->bRequest, urb->status);
 
-	if (type & CH343_CTT_M) {
-		status = ~data[len - 1] & CH343_CTI_ST;
-		if (ch343->chiptype == CHIP_CH344L ||
-		    ch343->chiptype == CHIP_CH344L_V2)
-			status &= CH343_CTI_C;
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	ch343_cr_account(ch343, cr);
+	cr->status = urb->status ? urb->status : urb->actual_length;
+	if (ch343->cr_active == cr)
+		ch343->cr_active = NULL;
+	ch343_cr_finish(ch343, cr);
+	ch343_cr_kick(ch343);
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
+}
 
-		if (!ch343->clocal &&
-		    (ch343->ctrlin & status & CH343_CTI_DC)) {
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0))
-			struct tty_struct *tty =
-				tty_port_tty_get(&ch343->port);
-			tty_hangup(tty);
-#else
-			tty_port_tty_hangup(&ch343->port, false);
-#endif
-		}
+/*
+ * Whether a barrier request must still wait: tx urbs are in flight or
+ * parked for resume, or the chip may still be sending the last one. In
+ * the latter case cr_drain_timer kicks the queue once it has drained,
+ * otherwise ch343_write_done() does. Called with write_lock held.
+ */
+static bool ch343_cr_barrier_held(struct ch343 *ch343)
+{
+	ktime_t now;
 
-		spin_lock_irqsave(&ch343->read_lock, flags);
-		difference = status ^ ch343->ctrlin;
-		ch343->ctrlin = status;
-		ch343->oldcount = ch343->iocount;
+	if (ch343->transmitting || !usb_anchor_empty(&ch343->delayed))
+		return true;
 
-		if (difference) {
-			if (difference & CH343_CTI_C) {
-				ch343->iocount.cts++;
-			}
-			if (difference & CH343_CTI_DS) {
-				ch343->iocount.dsr++;
-			}
-			if (difference & CH343_CTI_R) {
-				ch343->iocount.rng++;
-			}
-			if (difference & CH343_CTI_DC) {
-				ch343->iocount.dcd++;
-			}
-			spin_unlock_irqrestore(&ch343->read_lock, flags);
-			wake_up_interruptible(&ch343->wioctl);
-		} else
-			spin_unlock_irqrestore(&ch343->read_lock, flags);
-		handled = 1;
-	}
-	if (type & CH343_CTT_B) {
-		spin_lock_irqsave(&ch343->read_lock, flags);
-		ch343->oldcount = ch343->iocount;
-		ch343->iocount.brk++;
-		spin_unlock_irqrestore(&ch343->read_lock, flags);
-		handled = 1;
-	}
-	if (type & CH343_CTT_O) {
-		spin_lock_irqsave(&ch343->read_lock, flags);
-		ch343->oldcount = ch343->iocount;
-		ch343->iocount.overrun++;
-		spin_unlock_irqrestore(&ch343->read_lock, flags);
-		handled = 1;
-	}
-	if ((type & CH343_CTT_F) == CH343_CTT_F) {
-		spin_lock_irqsave(&ch343->read_lock, flags);
-		ch343->oldcount = ch343->iocount;
-		ch343->iocount.frame++;
-		spin_unlock_irqrestore(&ch343->read_lock, flags);
-		handled = 1;
-	} else if (type & CH343_CTT_P) {
-		spin_lock_irqsave(&ch343->read_lock, flags);
-		ch343->oldcount = ch343->iocount;
-		ch343->iocount.parity++;
-		spin_unlock_irqrestore(&ch343->read_lock, flags);
-		handled = 1;
+	now = ktime_get();
+	if (ktime_before(now, ch343->tx_drained)) {
+		hrtimer_start(&ch343->cr_drain_timer,
+			      ktime_sub(ch343->tx_drained, now),
+			      HRTIMER_MODE_REL);
+		return true;
 	}
-	if (!handled)
-		dev_err(&ch343->control->dev,
-			"%s - unknown status received:"
-			"len:%d, data0:0x%x, data1:0x%x\n",
-			__func__, (int)len, data[0], data[1]);
+
+	return false;
 }
 
-static void ch343_ctrl_irq(struct urb *urb)
+static enum hrtimer_restart ch343_cr_drain_timer(struct hrtimer *timer)
 {
-	struct ch343 *ch343 = urb->context;
-	unsigned char *data = urb->transfer_buffer;
-	unsigned int len = urb->actual_length;
-	int status = urb->status;
-	int retval;
+	struct ch343 *ch343 = container_of(timer, struct ch343,
+					   cr_drain_timer);
+	unsigned long flags;
 
-	switch (status) {
-	case 0:
-		/* success */
-		break;
-	case -ECONNRESET:
-	case -ENOENT:
-	case -ESHUTDOWN:
-		/* this urb is terminated, clean up */
-		dev_dbg(&ch343->control->dev,
-			"%s - urb shutting down with status: %d\n",
-			__func__, status);
-		return;
-	default:
-		dev_dbg(&ch343->control->dev,
-			"%s - nonzero urb status received: %d\n", __func__,
-			status);
-		goto exit;
-	}
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	ch343_cr_kick(ch343);
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
 
-	usb_mark_last_busy(ch343->dev);
-	ch343_update_status(ch343, data, len);
-exit:
-	retval = usb_submit_urb(urb, GFP_ATOMIC);
-	if (retval && retval != -EPERM)
+	return HRTIMER_NORESTART;
+}
+
+/* Called with write_lock held. */
+static void ch343_cr_kick(struct ch343 *ch343)
+{
+	struct ch343_cr *cr;
+	int rv;
+
+	while (!ch343->cr_active && !list_empty(&ch343->cr_queue)) {
+		if (ch343->susp_count && !ch343->disconnected)
+			return;
+		cr = list_first_entry(&ch343->cr_queue, struct ch343_cr,
+				      list);
+		if (cr->barrier && !ch343->disconnected &&
+		    ch343_cr_barrier_held(ch343))
+			return;
+		list_del(&cr->list);
+		if (ch343->disconnected) {
+			cr->status = -ENODEV;
+			ch343_cr_finish(ch343, cr);
+			continue;
+		}
+		cr->submit = ktime_get();
+		rv = usb_submit_urb(cr->urb, GFP_ATOMIC);
+		if (!rv) {
+			ch343->cr_active = cr;
+			return;
+		}
 		dev_err(&ch343->control->dev,
-			"%s - usb_submit_urb failed: %d\n", __func__,
-			retval);
+			"%s - usb_submit_urb(ctrl req) failed: %d\n",
+			__func__, rv);
+		cr->status = rv;
+		ch343_cr_finish(ch343, cr);
+	}
 }
 
-static int ch343_submit_read_urb(struct ch343 *ch343, int index,
-				 gfp_t mem_flags)
+/*
+ * Take an idle control request and set it up. May sleep for a free
+ * request if can_sleep is set, otherwise returns NULL when none is idle.
+ */
+static struct ch343_cr *ch343_cr_get(struct ch343 *ch343, u8 requesttype,
+				     u8 request, u16 value, u16 index,
+				     u16 size, bool can_sleep)
 {
-	int res;
+	struct ch343_cr *cr = NULL;
+	ktime_t requested = ktime_get();
+	unsigned long flags;
 
-	if (!test_and_clear_bit(index, &ch343->read_urbs_free))
-		return 0;
+	if (size > CH343_CR_BUFSIZE)
+		return NULL;
 
-	res = usb_submit_urb(ch343->read_urbs[index], mem_flags);
-	if (res) {
-		if (res != -EPERM) {
-			dev_err(&ch343->data->dev,
-				"%s - usb_submit_urb failed: %d\n",
-				__func__, res);
+	for (;;) {
+		spin_lock_irqsave(&ch343->write_lock, flags);
+		/* disconnect is set under write_lock, see ch343_disconnect() */
+		if (ch343->disconnected) {
+			spin_unlock_irqrestore(&ch343->write_lock, flags);
+			return NULL;
 		}
-		set_bit(index, &ch343->read_urbs_free);
-		return res;
+		if (!list_empty(&ch343->cr_free)) {
+			cr = list_first_entry(&ch343->cr_free,
+					      struct ch343_cr, list);
+			list_del(&cr->list);
+		}
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		if (cr || !can_sleep)
+			break;
+		if (!wait_event_timeout(ch343->cr_wait,
+					!list_empty(&ch343->cr_free) ||
+						ch343->disconnected,
+					msecs_to_jiffies(DEFAULT_TIMEOUT)) ||
+		    ch343->disconnected)
+			return NULL;
 	}
-	return 0;
+	if (!cr)
+		return NULL;
+
+	cr->dr->bRequestType = requesttype;
+	cr->dr->bRequest = request;
+	cr->dr->wValue = cpu_to_le16(value);
+	cr->dr->wIndex = cpu_to_le16(index);
+	cr->dr->wLength = cpu_to_le16(size);
+	usb_fill_control_urb(cr->urb, ch343->dev,
+			     requesttype & USB_DIR_IN ?
+				     usb_rcvctrlpipe(ch343->dev, 0) :
+				     usb_sndctrlpipe(ch343->dev, 0),
+			     (unsigned char *)cr->dr, cr->buf, size,
+			     ch343_cr_callback, cr);
+	cr->status = 0;
+	cr->waited = false;
+	cr->pm = false;
+	cr->timedout = false;
+	cr->barrier = false;
+	cr->elided = false;
+	cr->complete = NULL;
+	cr->context = NULL;
+	cr->shadow = NULL;
+	cr->requested = requested;
+
+	return cr;
 }
 
-static int ch343_submit_read_urbs(struct ch343 *ch343, gfp_t mem_flags)
+static void ch343_cr_put(struct ch343 *ch343, struct ch343_cr *cr)
 {
-	int res;
-	int i;
+	unsigned long flags;
 
-	for (i = 0; i < ch343->rx_buflimit; ++i) {
-		res = ch343_submit_read_urb(ch343, i, mem_flags);
-		if (res)
-			return res;
-	}
-	return 0;
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	list_add_tail(&cr->list, &ch343->cr_free);
+	wake_up(&ch343->cr_wait);
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
 }
 
-static void ch343_process_read_urb(struct ch343 *ch343, struct urb *urb)
+/*
+ * Check a request against its shadow slot, called with write_lock held.
+ * The slot is updated when the request is queued rather than when it
+ * completes, so that it always matches what the device will hold once
+ * the queue has drained. A failed request invalidates its slot.
+ */
+static bool ch343_shadow_hit(struct ch343 *ch343, struct ch343_cr *cr)
 {
-	if (!urb->actual_length)
-		return;
+	struct ch343_shadow *sh = cr->shadow;
+	u16 value = le16_to_cpu(cr->dr->wValue);
+	u16 index = le16_to_cpu(cr->dr->wIndex);
+
+	if (sh->valid && sh->request == cr->dr->bRequest &&
+	    sh->value == value && sh->index == index) {
+		ch343->shadow_hits++;
+		return true;
+	}
 
-	ch343->iocount.rx += urb->actual_length;
+	/* enabling or disabling the port may reset its line coding */
+	if (sh == &ch343->shadow[CH343_SH_PORT])
+		ch343->shadow[CH343_SH_LINE].valid = false;
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0))
-	tty_insert_flip_string(&ch343->port, urb->transfer_buffer,
-			       urb->actual_length);
-	tty_flip_buffer_push(&ch343->port);
-#else
-	struct tty_struct *tty = tty_port_tty_get(&ch343->port);
-	tty_insert_flip_string(tty, urb->transfer_buffer,
-			       urb->actual_length);
-	tty_flip_buffer_push(tty);
-#endif
+	sh->valid = true;
+	sh->request = cr->dr->bRequest;
+	sh->value = value;
+	sh->index = index;
+
+	return false;
 }
 
-static void ch343_read_bulk_callback(struct urb *urb)
+/*
+ * Fold a modem line update into the one at the tail of the queue if
+ * that has not reached the bus yet, the lines then go straight to their
+ * final state. Only the tail is merged so the order against other
+ * requests is kept. Called with write_lock held.
+ */
+static bool ch343_cr_coalesce(struct ch343 *ch343, struct ch343_cr *cr)
 {
-	struct ch343_rb *rb = urb->context;
-	struct ch343 *ch343 = rb->instance;
-	int status = urb->status;
+	struct ch343_cr *tail;
 
-	if (!ch343->dev) {
-		set_bit(rb->index, &ch343->read_urbs_free);
-		dev_dbg(&ch343->data->dev, "%s - disconnected\n",
-			__func__);
-		return;
-	}
+	/* a completion callback must see its own request on the bus */
+	if (cr->shadow != &ch343->shadow[CH343_SH_MODEM] || cr->waited ||
+	    cr->complete || list_empty(&ch343->cr_queue))
+		return false;
 
-	if (status) {
-		set_bit(rb->index, &ch343->read_urbs_free);
-		dev_dbg(&ch343->data->dev,
-			"%s - non-zero urb status: %d\n", __func__,
-			status);
-		return;
-	}
+	tail = list_last_entry(&ch343->cr_queue, struct ch343_cr, list);
+	if (tail->shadow != cr->shadow || tail->waited || tail->complete ||
+	    tail->dr->bRequest != cr->dr->bRequest)
+		return false;
 
-	usb_mark_last_busy(ch343->dev);
-	ch343_process_read_urb(ch343, urb);
-	set_bit(rb->index, &ch343->read_urbs_free);
-	ch343_submit_read_urb(ch343, rb->index, GFP_ATOMIC);
+	tail->dr->wValue = cr->dr->wValue;
+	tail->dr->wIndex = cr->dr->wIndex;
+	ch343->cr_coalesced++;
+
+	return true;
 }
 
-static void ch343_write_bulk(struct urb *urb)
+/*
+ * Queue a request taken with ch343_cr_get(). Requests nobody waits for
+ * hold an async autopm reference until they complete, a waiting caller
+ * is expected to hold a reference of its own. A request whose shadow
+ * slot already holds its value completes at once without being sent.
+ */
+static int ch343_cr_submit(struct ch343 *ch343, struct ch343_cr *cr)
 {
-	struct ch343_wb *wb = urb->context;
-	struct ch343 *ch343 = wb->instance;
 	unsigned long flags;
-	int status = urb->status;
+	int rv;
 
-	if (status || (urb->actual_length != urb->transfer_buffer_length))
-		dev_vdbg(&ch343->data->dev, "%s - len %d/%d, status %d\n",
-			 __func__, urb->actual_length,
-			 urb->transfer_buffer_length, status);
+	if (cr->waited) {
+		init_completion(&cr->done);
+	} else {
+		rv = usb_autopm_get_interface_async(ch343->control);
+		if (rv) {
+			ch343_cr_put(ch343, cr);
+			return rv;
+		}
+		cr->pm = true;
+	}
 
-	ch343->iocount.tx += urb->actual_length;
 	spin_lock_irqsave(&ch343->write_lock, flags);
-	ch343_write_done(ch343, wb);
-	wake_up_interruptible(&ch343->sendioctl);
+	if (ch343->disconnected) {
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		if (cr->pm)
+			usb_autopm_put_interface_async(ch343->control);
+		ch343_cr_put(ch343, cr);
+		return -ENODEV;
+	}
+	if ((cr->shadow && ch343_shadow_hit(ch343, cr)) ||
+	    ch343_cr_coalesce(ch343, cr)) {
+		/* nothing goes on the bus, so there is nothing to order */
+		cr->barrier = false;
+		cr->elided = true;
+		ch343_cr_finish(ch343, cr);
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		return 0;
+	}
+	/* coalesced requests are counted in cr_coalesced instead */
+	if (cr->shadow)
+		ch343->shadow_misses++;
+	/* other vendor writes may change registers behind the cache */
+	if (!(cr->dr->bRequestType & USB_DIR_IN))
+		ch343_regs_touched(ch343, cr->dr->bRequest);
+	if (cr->barrier)
+		ch343->cr_barriers++;
+	list_add_tail(&cr->list, &ch343->cr_queue);
+	ch343_cr_kick(ch343);
 	spin_unlock_irqrestore(&ch343->write_lock, flags);
-	schedule_work(&ch343->work);
+
+	return 0;
 }
 
-static void ch343_softint(struct work_struct *work)
+/*
+ * Wait for a request submitted with cr->waited set. On timeout the
+ * request is dequeued or killed. The caller still owns the request.
+ */
+static int ch343_cr_wait(struct ch343 *ch343, struct ch343_cr *cr)
 {
-	struct ch343 *ch343 = container_of(work, struct ch343, work);
-#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0))
-	struct tty_struct *tty;
+	if (wait_for_completion_timeout(&cr->done,
+					msecs_to_jiffies(DEFAULT_TIMEOUT)))
+		return cr->status;
 
-	tty = tty_port_tty_get(&ch343->port);
-	if (!tty)
-		return;
-	tty_wakeup(tty);
-	tty_kref_put(tty);
-#else
-	tty_port_tty_wakeup(&ch343->port);
-#endif
+	spin_lock_irq(&ch343->write_lock);
+	if (completion_done(&cr->done)) {
+		spin_unlock_irq(&ch343->write_lock);
+		return cr->status;
+	}
+	if (ch343->cr_active != cr) {
+		/* stalled behind the queue, no bus latency to record */
+		ch343->cr_stats[ch343_cr_class(cr->dr->bRequest)].timeouts++;
+		list_del(&cr->list);
+		if (cr->barrier && !--ch343->cr_barriers)
+			schedule_work(&ch343->work);
+		cr->barrier = false;
+		if (cr->shadow)
+			cr->shadow->valid = false;
+		cr->shadow = NULL;
+		spin_unlock_irq(&ch343->write_lock);
+		return -ETIMEDOUT;
+	}
+	cr->timedout = true;
+	spin_unlock_irq(&ch343->write_lock);
+
+	usb_kill_urb(cr->urb);
+	wait_for_completion(&cr->done);
+
+	return -ETIMEDOUT;
 }
 
-static int ch343_tty_install(struct tty_driver *driver,
-			     struct tty_struct *tty)
+/*
+ * Issue a vendor request and wait for it, for callers that need the
+ * result or must not return before the device has applied it.
+ */
+static int ch343_cr_sync(struct ch343 *ch343, u8 requesttype, u8 request,
+			 u16 value, u16 index, void *data, u16 size,
+			 struct ch343_shadow *sh)
 {
-	struct ch343 *ch343;
-	int retval;
+	struct ch343_cr *cr;
+	int rv;
 
-	ch343 = ch343_get_by_index(tty->index);
-	if (!ch343)
-		return -ENODEV;
+	rv = usb_autopm_get_interface(ch343->control);
+	if (rv)
+		return rv;
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0))
-	retval = tty_standard_install(driver, tty);
-	if (retval)
-		goto error_init_termios;
+	cr = ch343_cr_get(ch343, requesttype, request, value, index, size,
+			  true);
+	if (!cr) {
+		rv = ch343->disconnected ? -ENODEV : -EBUSY;
+		goto out;
+	}
+	if (!(requesttype & USB_DIR_IN) && size)
+		memcpy(cr->buf, data, size);
+	cr->waited = true;
+	cr->shadow = sh;
 
-	tty->driver_data = ch343;
-#else
-	retval = tty_init_termios(tty);
-	if (retval)
-		goto error_init_termios;
+	rv = ch343_cr_submit(ch343, cr);
+	if (rv)
+		goto out;
+	rv = ch343_cr_wait(ch343, cr);
+	if ((requesttype & USB_DIR_IN) && rv > 0)
+		memcpy(data, cr->buf, rv);
+	ch343_cr_put(ch343, cr);
 
-	tty->driver_data = ch343;
+out:
+	usb_autopm_put_interface(ch343->control);
+	return rv;
+}
 
-	/* Final install (we use the default method) */
-	tty_driver_kref_get(driver);
-	tty->count++;
-	driver->ttys[tty->index] = tty;
-#endif
+static bool ch343_cr_idle(struct ch343 *ch343)
+{
+	bool idle;
 
-	return 0;
+	spin_lock_irq(&ch343->write_lock);
+	idle = !ch343->cr_active && list_empty(&ch343->cr_queue);
+	spin_unlock_irq(&ch343->write_lock);
 
-error_init_termios:
-	tty_port_put(&ch343->port);
-	return retval;
+	return idle;
 }
 
-static int ch343_tty_open(struct tty_struct *tty, struct file *filp)
+/*
+ * Wait until every control request queued so far has completed, for
+ * callers that need asynchronous updates such as modem lines to have
+ * reached the device.
+ */
+static int ch343_cr_drain(struct ch343 *ch343)
 {
-	struct ch343 *ch343 = tty->driver_data;
+	long rv;
 
-	if (tty)
-		ch343_tty_set_termios(tty, NULL);
+	rv = wait_event_interruptible_timeout(
+		ch343->cr_wait, ch343_cr_idle(ch343) || ch343->disconnected,
+		msecs_to_jiffies(DEFAULT_TIMEOUT));
+	if (rv < 0)
+		return rv;
+	if (ch343->disconnected)
+		return -ENODEV;
 
-	return tty_port_open(&ch343->port, tty, filp);
+	return rv ? 0 : -ETIMEDOUT;
 }
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0))
-static void ch343_port_dtr_rts(struct tty_port *port, bool raise)
-#else
-static void ch343_port_dtr_rts(struct tty_port *port, int raise)
-#endif
+static int ch343_control_out(struct ch343 *ch343, u8 request, u16 value,
+			     u16 index)
 {
-	struct ch343 *ch343 = container_of(port, struct ch343, port);
-	int res;
+	return ch343_cr_sync(ch343,
+			     USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_OUT,
+			     request, value, index, NULL, 0, NULL);
+}
 
-#ifdef IGNORE_RTSDTR
-	return;
-#endif
+static int ch343_control_in(struct ch343 *ch343, u8 request, u16 value,
+			    u16 index, char *buf, unsigned bufsize)
+{
+	return ch343_cr_sync(ch343,
+			     USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_IN,
+			     request, value, index, buf, bufsize, NULL);
+}
 
-	if (raise)
-		ch343->ctrlout |= CH343_CTO_D | CH343_CTO_R;
-	else
-		ch343->ctrlout &= ~(CH343_CTO_D | CH343_CTO_R);
+/*
+ * Queue a vendor out request without waiting for it, the result is only
+ * logged. Returns 0 once the request is queued. A barrier request is
+ * held back until the data written before it has left the chip.
+ */
+static int ch343_cr_async(struct ch343 *ch343, u8 request, u16 value,
+			  u16 index, struct ch343_shadow *sh, bool barrier)
+{
+	struct ch343_cr *cr;
 
-	res = ch343_set_control(ch343, ch343->ctrlout);
-	if (res)
-		dev_err(&ch343->control->dev, "failed to set dtr/rts\n");
+	cr = ch343_cr_get(ch343,
+			  USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_OUT,
+			  request, value, index, 0, true);
+	if (!cr)
+		return ch343->disconnected ? -ENODEV : -EBUSY;
+	cr->shadow = sh;
+	cr->barrier = barrier;
+
+	return ch343_cr_submit(ch343, cr);
 }
 
-static int ch343_port_activate(struct tty_port *port,
-			       struct tty_struct *tty)
+/*
+ * Write device state mirrored in shadow slot @slot. The request is
+ * skipped if the device already holds the value. With CH343_CR_WAIT
+ * the caller sleeps until the device has applied it, CH343_CR_BARRIER
+ * orders it behind the transmit data queued so far.
+ */
+static int ch343_set_state(struct ch343 *ch343, int slot, u8 request,
+			   u16 value, u16 index, unsigned int flags)
 {
-	struct ch343 *ch343 = container_of(port, struct ch343, port);
-	int retval = -ENODEV;
-	int i;
-
-	mutex_lock(&ch343->mutex);
-	if (ch343->disconnected)
-		goto disconnected;
+	struct ch343_shadow *sh = &ch343->shadow[slot];
 
-	retval = usb_autopm_get_interface(ch343->control);
-	if (retval)
-		goto error_get_interface;
+	if (flags & CH343_CR_WAIT)
+		return ch343_cr_sync(ch343,
+				     USB_TYPE_VENDOR | USB_RECIP_DEVICE |
+					     USB_DIR_OUT,
+				     request, value, index, NULL, 0, sh);
 
-	set_bit(TTY_NO_WRITE_SPLIT, &tty->flags);
-	ch343->control->needs_remote_wakeup = 1;
+	return ch343_cr_async(ch343, request, value, index, sh,
+			      flags & CH343_CR_BARRIER);
+}
 
-	retval = usb_submit_urb(ch343->ctrlurb, GFP_KERNEL);
-	if (retval) {
-		dev_err(&ch343->control->dev,
-			"%s - usb_submit_urb(ctrl cmd) failed\n",
-			__func__);
-		goto error_submit_urb;
-	}
-	retval = ch343_submit_read_urbs(ch343, GFP_KERNEL);
-	if (retval)
-		goto error_submit_read_urbs;
+static int ch343_cr_alloc(struct ch343 *ch343)
+{
+	struct ch343_cr *cr;
+	int i;
 
-	if (ch343->chiptype == CHIP_CH9114L ||
-	    ch343->chiptype == CHIP_CH9114F ||
-	    ch343->chiptype == CHIP_CH9114W ||
-	    ch343->chiptype == CHIP_CH346C_M2) {
-		retval = ch343_control_out(
-			ch343, CMD_C8, 0x01 | (ch343->iface << 8), 0x00);
-		if (retval) {
-			goto error_submit_read_urbs;
-		}
+	INIT_LIST_HEAD(&ch343->cr_free);
+	INIT_LIST_HEAD(&ch343->cr_queue);
+	init_waitqueue_head(&ch343->cr_wait);
+
+	for (i = 0; i < CH343_NCR; i++) {
+		cr = &ch343->cr[i];
+		cr->instance = ch343;
+		cr->urb = usb_alloc_urb(0, GFP_KERNEL);
+		cr->dr = kmalloc(sizeof(*cr->dr), GFP_KERNEL);
+		cr->buf = kmalloc(CH343_CR_BUFSIZE, GFP_KERNEL);
+		if (!cr->urb || !cr->dr || !cr->buf)
+			return -ENOMEM;
+		list_add_tail(&cr->list, &ch343->cr_free);
 	}
 
-	usb_autopm_put_interface(ch343->control);
-	mutex_unlock(&ch343->mutex);
-
 	return 0;
-
-error_submit_read_urbs:
-	for (i = 0; i < ch343->rx_buflimit; i++)
-		usb_kill_urb(ch343->read_urbs[i]);
-error_submit_urb:
-	usb_kill_urb(ch343->ctrlurb);
-	usb_autopm_put_interface(ch343->control);
-error_get_interface:
-disconnected:
-	mutex_unlock(&ch343->mutex);
-	return usb_translate_errors(retval);
 }
 
-static void ch343_port_destruct(struct tty_port *port)
+static void ch343_cr_free(struct ch343 *ch343)
 {
-	struct ch343 *ch343 = container_of(port, struct ch343, port);
+	struct ch343_cr *cr;
+	int i;
 
-	ch343_release_minor(ch343);
-	usb_put_intf(ch343->control);
-	memset(ch343, 0x00, sizeof(struct ch343));
-	kfree(ch343);
+	for (i = 0; i < CH343_NCR; i++) {
+		cr = &ch343->cr[i];
+		usb_free_urb(cr->urb);
+		kfree(cr->dr);
+		kfree(cr->buf);
+		cr->urb = NULL;
+		cr->dr = NULL;
+		cr->buf = NULL;
+	}
 }
 
-static void ch343_port_shutdown(struct tty_port *port)
+/*
+ * Fail queued control requests and kill the one in flight, called once
+ * the device is marked disconnected.
+ */
+static void ch343_cr_flush(struct ch343 *ch343)
 {
-	struct ch343 *ch343 = container_of(port, struct ch343, port);
-	struct urb *urb;
-	struct ch343_wb *wb;
 	int i;
-	int r;
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0))
+	spin_lock_irq(&ch343->write_lock);
+	ch343_cr_kick(ch343);
+	spin_unlock_irq(&ch343->write_lock);
 
-	usb_autopm_get_interface_no_resume(ch343->control);
-	ch343->control->needs_remote_wakeup = 0;
-	usb_autopm_put_interface(ch343->control);
+	for (i = 0; i < CH343_NCR; i++)
+		usb_kill_urb(ch343->cr[i].urb);
+}
 
-	for (;;) {
-		urb = usb_get_from_anchor(&ch343->delayed);
-		if (!urb)
-			break;
-		wb = urb->context;
-		wb->use = 0;
-		usb_autopm_put_interface_async(ch343->control);
-	}
+static int ch343_control_msg_out(struct ch343 *ch343, u8 request,
+				 u8 requesttype, u16 value, u16 index,
+				 void *buf, unsigned bufsize)
+{
+	int retval;
+	char *buffer;
 
-	usb_kill_urb(ch343->ctrlurb);
-	for (i = 0; i < CH343_NW; i++)
-		usb_kill_urb(ch343->wb[i].urb);
-	for (i = 0; i < ch343->rx_buflimit; i++)
-		usb_kill_urb(ch343->read_urbs[i]);
+	buffer = kmalloc(bufsize, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
 
-#else
-	mutex_lock(&ch343->mutex);
-	if (!ch343->disconnected) {
-		usb_autopm_get_interface(ch343->control);
-		ch343_set_control(ch343, ch343->ctrlout = 0);
+	retval = copy_from_user(buffer, (char __user *)buf, bufsize);
+	if (retval)
+		goto out;
 
-		usb_kill_urb(ch343->ctrlurb);
-		for (i = 0; i < CH343_NW; i++)
-			usb_kill_urb(ch343->wb[i].urb);
-		for (i = 0; i < ch343->rx_buflimit; i++)
-			usb_kill_urb(ch343->read_urbs[i]);
-		ch343->control->needs_remote_wakeup = 0;
+	retval = usb_autopm_get_interface(ch343->control);
+	if (retval)
+		goto out;
+	retval = usb_control_msg(ch343->dev,
+				 usb_sndctrlpipe(ch343->dev, 0), request,
+				 requesttype, value, index, buffer,
+				 bufsize, DEFAULT_TIMEOUT);
+	usb_autopm_put_interface(ch343->control);
 
-		usb_autopm_put_interface(ch343->control);
-	}
-	mutex_unlock(&ch343->mutex);
-#endif
+out:
+	kfree(buffer);
+	return retval;
+}
 
-	if (ch343->chiptype == CHIP_CH9114L ||
-	    ch343->chiptype == CHIP_CH9114F ||
-	    ch343->chiptype == CHIP_CH9114W ||
-	    ch343->chiptype == CHIP_CH346C_M2) {
-		r = ch343_control_out(ch343, CMD_C8,
-				      0x02 | (ch343->iface << 8), 0x00);
-		if (r)
-			dev_err(&ch343->control->dev, "%s - failed: %d\n",
-				__func__, r);
+static int ch343_control_msg_in(struct ch343 *ch343, u8 request,
+				u8 requesttype, u16 value, u16 index,
+				void *buf, unsigned bufsize)
+{
+	int retval;
+	char *buffer;
+
+	buffer = kmalloc(bufsize, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	retval = usb_autopm_get_interface(ch343->control);
+	if (retval)
+		goto out;
+	retval = usb_control_msg(ch343->dev,
+				 usb_rcvctrlpipe(ch343->dev, 0), request,
+				 requesttype, value, index, buffer,
+				 bufsize, DEFAULT_TIMEOUT);
+	if (retval > 0) {
+		if (copy_to_user((char __user *)buf, buffer, retval)) {
+			retval = -EFAULT;
+		}
 	}
+	usb_autopm_put_interface(ch343->control);
+
+out:
+	kfree(buffer);
+	return retval;
 }
 
-static void ch343_tty_cleanup(struct tty_struct *tty)
+/* Modem control request of this port, 0 if it has none. */
+static u8 ch343_modem_request(struct ch343 *ch343)
 {
-	struct ch343 *ch343 = tty->driver_data;
-	tty_port_put(&ch343->port);
+	if (ch343->iface <= 1)
+		return CMD_C2 + ch343->iface;
+	else if (ch343->iface <= 3)
+		return CMD_C2 + 0x10 + (ch343->iface - 2);
+	else
+		return 0;
 }
 
-static void ch343_tty_hangup(struct tty_struct *tty)
+static inline int ch343_set_control(struct ch343 *ch343, int control)
 {
-	struct ch343 *ch343 = tty->driver_data;
-	tty_port_hangup(&ch343->port);
+	u8 request = ch343_modem_request(ch343);
+
+	if (!request)
+		return -1;
+
+	return ch343_set_state(ch343, CH343_SH_MODEM, request, ~control,
+			       0x0000, 0);
 }
 
-static void ch343_tty_close(struct tty_struct *tty, struct file *filp)
+/*
+ * Change the output lines in ctrlout under write_lock, which the modem
+ * sequence timer holds as well. Returns the new value, @changed tells
+ * whether it differs from the old one.
+ */
+static unsigned int ch343_ctrlout_update(struct ch343 *ch343,
+					 unsigned int clear, unsigned int set,
+					 bool *changed)
 {
-	struct ch343 *ch343 = tty->driver_data;
-	tty_port_close(&ch343->port, tty, filp);
-}
+	unsigned int old, ctrl;
+	unsigned long flags;
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0))
-static ssize_t ch343_tty_write(struct tty_struct *tty, const u8 *buf,
-			       size_t count)
-#else
-static int ch343_tty_write(struct tty_struct *tty,
-			   const unsigned char *buf, int count)
-#endif
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	old = ch343->ctrlout;
+	ctrl = (old & ~clear) | set;
+	ch343->ctrlout = ctrl;
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
+
+	if (changed)
+		*changed = ctrl != old;
+	return ctrl;
+}
+
+/* Value and index of the CMD_C4 request setting the break @state. */
+static void ch343_break_encode(struct ch343 *ch343, int state, u16 *value,
+			       u16 *index)
 {
-	struct ch343 *ch343 = tty->driver_data;
-	int stat;
-	unsigned long flags;
-	int wbn;
-	struct ch343_wb *wb;
-	int timeout;
+	u16 reg_contents;
+	bool per_port;
 
-	if (!count)
-		return 0;
+	per_port = ch343->info->flags & CH343_CI_BREAK_PORT;
 
-retry:
-	spin_lock_irqsave(&ch343->write_lock, flags);
-	wbn = ch343_wb_alloc(ch343);
-	if (wbn < 0) {
-		spin_unlock_irqrestore(&ch343->write_lock, flags);
-		timeout = wait_event_interruptible_timeout(
-			ch343->sendioctl, ch343_wb_is_avail(ch343),
-			msecs_to_jiffies(DEFAULT_TIMEOUT));
-		if (timeout <= 0) {
-			return -ETIMEDOUT;
-		} else
-			goto retry;
-	}
-	wb = &ch343->wb[wbn];
+	if (per_port)
+		reg_contents = ch343->iface | (state ? 0x0100 : 0x0000);
+	else if (state)
+		reg_contents = CH343_N_B;
+	else
+		reg_contents = CH343_N_B | CH343_N_AB;
 
-	if (!ch343->dev) {
-		wb->use = 0;
-		spin_unlock_irqrestore(&ch343->write_lock, flags);
-		return -ENODEV;
+	if (!per_port && ch343->iface) {
+		*value = 0x00;
+		*index = reg_contents;
+	} else {
+		*value = reg_contents;
+		*index = 0x00;
 	}
+}
 
-	count = (count > ch343->writesize) ? ch343->writesize : count;
+/*
+ * Timed sequences. Each op is issued from seq.timer as an asynchronous
+ * control request or bulk urb, its completion arms the timer for the
+ * hold time and the timer then issues the next op. Nothing sleeps
+ * between ops, so the timing is bounded by the bus rather than by
+ * the scheduler.
+ */
 
-	memcpy(wb->buf, buf, count);
-	wb->len = count;
+/* Called with write_lock held. */
+static void ch343_seq_finish(struct ch343 *ch343, int status)
+{
+	ch343->seq.active = false;
+	ch343->seq.status = status;
+	complete(&ch343->seq.done);
+}
 
-	stat = usb_autopm_get_interface_async(ch343->control);
-	if (stat) {
-		wb->use = 0;
-		spin_unlock_irqrestore(&ch343->write_lock, flags);
-		return stat;
-	}
+/* Completion of an op of run @gen, called with write_lock held. */
+static void ch343_seq_advance(struct ch343 *ch343, u32 gen, int status,
+			      bool elided)
+{
+	struct ch343_seq *seq = &ch343->seq;
+	struct ch343_seqop *op;
 
-	if (ch343->susp_count) {
-		usb_anchor_urb(wb->urb, &ch343->delayed);
-		spin_unlock_irqrestore(&ch343->write_lock, flags);
-		return count;
+	if (!seq->active || gen != seq->gen)
+		return;
+	if (status < 0) {
+		ch343_seq_finish(ch343, status);
+		return;
 	}
 
-	stat = ch343_start_wb(ch343, wb);
-	spin_unlock_irqrestore(&ch343->write_lock, flags);
+	op = &seq->ops[seq->index++];
+	op->done_ns = ktime_to_ns(ktime_sub(ktime_get(), seq->start));
+	op->elided = elided;
+	hrtimer_start(&seq->timer, ns_to_ktime((u64)op->delay_us * 1000),
+		      HRTIMER_MODE_REL);
+}
 
-	if (stat < 0)
-		return stat;
-	return count;
+static void ch343_seq_cr_done(struct ch343 *ch343, struct ch343_cr *cr)
+{
+	ch343_seq_advance(ch343, (u32)(unsigned long)cr->context, cr->status,
+			  cr->elided);
 }
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0))
-static unsigned int ch343_tty_write_room(struct tty_struct *tty)
-#else
-static int ch343_tty_write_room(struct tty_struct *tty)
-#endif
+/* Queues the payload of the sequence, called with write_lock held. */
+static int ch343_seq_data(struct ch343 *ch343)
 {
-	struct ch343 *ch343 = tty->driver_data;
+	struct ch343_wb *wb;
+	int wbn;
 
-	return ch343_wb_is_avail(ch343) ? ch343->writesize : 0;
+	if (ch343->susp_count)
+		return -EAGAIN;
+	wbn = ch343_wb_alloc(ch343);
+	if (wbn < 0)
+		return -EBUSY;
+	wb = &ch343->wb[wbn];
+	memcpy(wb->buf, ch343->seq.data, ch343->seq.len);
+	wb->len = ch343->seq.len;
+	wb->drain_ns = ch343_tx_drain_ns(ch343, wb->len);
+	wb->seq_gen = ch343->seq.gen;
+
+	return ch343_start_wb(ch343, wb);
 }
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0))
-static unsigned int ch343_tty_chars_in_buffer(struct tty_struct *tty)
-#else
-static int ch343_tty_chars_in_buffer(struct tty_struct *tty)
-#endif
+static enum hrtimer_restart ch343_seq_timer(struct hrtimer *timer)
 {
-	struct ch343 *ch343 = tty->driver_data;
+	struct ch343 *ch343 = container_of(timer, struct ch343, seq.timer);
+	struct ch343_seq *seq = &ch343->seq;
+	struct ch343_seqop *op;
+	struct ch343_cr *cr;
+	unsigned long flags;
+	unsigned int ctrl;
+	u16 value, index;
+	u8 request;
+	u32 gen;
+	int rv;
 
-	if (ch343->disconnected)
-		return 0;
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	if (!seq->active) {
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	if (seq->index == seq->nops) {
+		ch343_seq_finish(ch343, 0);
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	op = &seq->ops[seq->index];
+	gen = seq->gen;
+	switch (op->type) {
+	case CH343_SEQ_MODEM:
+		ctrl = ch343->ctrlout & ~(CH343_CTO_D | CH343_CTO_R);
+		ctrl |= op->arg;
+		ch343->ctrlout = ctrl;
+		request = ch343_modem_request(ch343);
+		value = ~ctrl;
+		index = 0;
+		break;
+	case CH343_SEQ_BREAK:
+		request = CMD_C4;
+		ch343_break_encode(ch343, op->arg, &value, &index);
+		break;
+	default:
+		rv = ch343_seq_data(ch343);
+		if (rv < 0 && seq->active)
+			ch343_seq_finish(ch343, rv);
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		return HRTIMER_NORESTART;
+	}
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
 
-	return (CH343_NW - ch343_wb_is_avail(ch343)) * ch343->writesize;
+	cr = ch343_cr_get(ch343,
+			  USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_DIR_OUT,
+			  request, value, index, 0, false);
+	if (!cr) {
+		rv = -EBUSY;
+		goto fail;
+	}
+	cr->shadow = &ch343->shadow[op->type == CH343_SEQ_MODEM ?
+				    CH343_SH_MODEM : CH343_SH_BREAK];
+	/* a break must not cut into data queued before the sequence */
+	cr->barrier = op->type == CH343_SEQ_BREAK && op->arg;
+	cr->complete = ch343_seq_cr_done;
+	cr->context = (void *)(unsigned long)gen;
+	rv = ch343_cr_submit(ch343, cr);
+	if (!rv)
+		return HRTIMER_NORESTART;
+
+fail:
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	if (seq->active && gen == seq->gen)
+		ch343_seq_finish(ch343, rv);
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
+	return HRTIMER_NORESTART;
 }
 
-static int ch343_tty_break_ctl(struct tty_struct *tty, int state)
+/*
+ * Runs the ops prepared in ch343->seq and waits for them, called with
+ * seq_mutex held. On return the ops carry their completion times and
+ * seq->index counts the ops that completed. Tty writes held with
+ * seq->hold_tx stay held until ch343_seq_release().
+ */
+static int ch343_seq_run(struct ch343 *ch343, u64 hold_us, u64 *total_ns)
 {
-	struct ch343 *ch343 = tty->driver_data;
-	int retval;
-	uint16_t reg_contents;
-	uint8_t *regbuf;
+	struct ch343_seq *seq = &ch343->seq;
+	unsigned long timeout;
+	long left;
+	int rv;
 
-	regbuf = kmalloc(2, GFP_KERNEL);
-	if (!regbuf)
-		return -1;
+	rv = usb_autopm_get_interface(ch343->control);
+	if (rv)
+		return rv;
 
-	if (state != 0) {
-		if (ch343->chiptype == CHIP_CH346C_M0 ||
-		    ch343->chiptype == CHIP_CH346C_M1 ||
-		    ch343->chiptype == CHIP_CH346C_M2 ||
-		    ch343->chiptype == CHIP_CH339W ||
-		    ch343->chiptype == CHIP_CH347TF ||
-		    ch343->chiptype == CHIP_CH344L ||
-		    ch343->chiptype == CHIP_CH344Q ||
-		    ch343->chiptype == CHIP_CH344L_V2 ||
-		    ch343->chiptype == CHIP_CH9104L ||
-		    ch343->chiptype == CHIP_CH9114L ||
-		    ch343->chiptype == CHIP_CH9114F ||
-		    ch343->chiptype == CHIP_CH9114W ||
-		    ch343->chiptype == CHIP_CH9111L_M0 ||
-		    ch343->chiptype == CHIP_CH9111L_M1) {
-			regbuf[0] = ch343->iface;
-			regbuf[1] = 0x01;
-		} else {
-			regbuf[0] = CH343_N_B;
-			regbuf[1] = 0x00;
-		}
-	} else {
-		if (ch343->chiptype == CHIP_CH346C_M0 ||
-		    ch343->chiptype == CHIP_CH346C_M1 ||
-		    ch343->chiptype == CHIP_CH346C_M2 ||
-		    ch343->chiptype == CHIP_CH339W ||
-		    ch343->chiptype == CHIP_CH347TF ||
-		    ch343->chiptype == CHIP_CH344L ||
-		    ch343->chiptype == CHIP_CH344Q ||
-		    ch343->chiptype == CHIP_CH344L_V2 ||
-		    ch343->chiptype == CHIP_CH9104L ||
-		    ch343->chiptype == CHIP_CH9114L ||
-		    ch343->chiptype == CHIP_CH9114F ||
-		    ch343->chiptype == CHIP_CH9114W ||
-		    ch343->chiptype == CHIP_CH9111L_M0 ||
-		    ch343->chiptype == CHIP_CH9111L_M1) {
-			regbuf[0] = ch343->iface;
-			regbuf[1] = 0x00;
-		} else {
-			regbuf[0] = CH343_N_B | CH343_N_AB;
-			regbuf[1] = 0x00;
-		}
-	}
-	reg_contents = get_unaligned_le16(regbuf);
-
-	if (ch343->chiptype == CHIP_CH346C_M0 ||
-	    ch343->chiptype == CHIP_CH346C_M1 ||
-	    ch343->chiptype == CHIP_CH346C_M2 ||
-	    ch343->chiptype == CHIP_CH339W ||
-	    ch343->chiptype == CHIP_CH347TF ||
-	    ch343->chiptype == CHIP_CH344L ||
-	    ch343->chiptype == CHIP_CH344Q ||
-	    ch343->chiptype == CHIP_CH344L_V2 ||
-	    ch343->chiptype == CHIP_CH9104L ||
-	    ch343->chiptype == CHIP_CH9114L ||
-	    ch343->chiptype == CHIP_CH9114F ||
-	    ch343->chiptype == CHIP_CH9114W ||
-	    ch343->chiptype == CHIP_CH9111L_M0 ||
-	    ch343->chiptype == CHIP_CH9111L_M1) {
-		retval = ch343_control_out(ch343, CMD_C4, reg_contents,
-					   0x00);
+	spin_lock_irq(&ch343->write_lock);
+	if (!++seq->gen)
+		seq->gen++;
+	seq->index = 0;
+	seq->status = 0;
+	reinit_completion(&seq->done);
+	seq->active = true;
+	seq->start = ktime_get();
+	spin_unlock_irq(&ch343->write_lock);
+	hrtimer_start(&seq->timer, 0, HRTIMER_MODE_REL);
+
+	timeout = usecs_to_jiffies(hold_us) +
+		  seq->nops * msecs_to_jiffies(DEFAULT_TIMEOUT);
+	left = wait_for_completion_interruptible_timeout(&seq->done, timeout);
+
+	spin_lock_irq(&ch343->write_lock);
+	if (seq->active) {
+		/* interrupted or timed out, late completions are ignored */
+		seq->active = false;
+		rv = left < 0 ? left : -ETIMEDOUT;
 	} else {
-		if (ch343->iface)
-			retval = ch343_control_out(ch343, CMD_C4, 0x00,
-						   reg_contents);
-		else
-			retval = ch343_control_out(ch343, CMD_C4,
-						   reg_contents, 0x00);
+		rv = seq->status;
 	}
+	*total_ns = ktime_to_ns(ktime_sub(ktime_get(), seq->start));
+	spin_unlock_irq(&ch343->write_lock);
+	hrtimer_cancel(&seq->timer);
 
-	if (retval < 0)
-		dev_err(&ch343->control->dev,
-			"%s - USB control write error (%d)\n", __func__,
-			retval);
+	usb_autopm_put_interface(ch343->control);
 
-	kfree(regbuf);
-	return retval;
+	return rv;
 }
 
-static int ch343_tty_tiocmget(struct tty_struct *tty)
+/* Lets tty writes held for a sequence go out again. */
+static void ch343_seq_release(struct ch343 *ch343)
 {
-	struct ch343 *ch343 = tty->driver_data;
-	unsigned long flags;
-	unsigned int result;
+	bool held;
 
-	spin_lock_irqsave(&ch343->read_lock, flags);
-	result = (ch343->ctrlout & CH343_CTO_D ? TIOCM_DTR : 0) |
-		 (ch343->ctrlout & CH343_CTO_R ? TIOCM_RTS : 0) |
-		 (ch343->ctrlin & CH343_CTI_C ? TIOCM_CTS : 0) |
-		 (ch343->ctrlin & CH343_CTI_DS ? TIOCM_DSR : 0) |
-		 (ch343->ctrlin & CH343_CTI_R ? TIOCM_RI : 0) |
-		 (ch343->ctrlin & CH343_CTI_DC ? TIOCM_CD : 0);
-	spin_unlock_irqrestore(&ch343->read_lock, flags);
+	spin_lock_irq(&ch343->write_lock);
+	held = ch343->seq.hold_tx;
+	ch343->seq.hold_tx = false;
+	spin_unlock_irq(&ch343->write_lock);
 
-	return result;
+	if (held)
+		schedule_work(&ch343->work);
 }
 
-static int ch343_tty_tiocmset(struct tty_struct *tty, unsigned int set,
-			      unsigned int clear)
+static int ch343_modem_seq(struct ch343 *ch343, void __user *arg)
 {
-	struct ch343 *ch343 = tty->driver_data;
-	unsigned int newctrl;
+	struct ch343_seq *seq = &ch343->seq;
+	struct ch343_modemseq *ms;
+	struct ch343_seqstep *step;
+	unsigned int i;
+	u64 hold_us = 0;
+	int rv;
+
+	if (!ch343_modem_request(ch343))
+		return -EINVAL;
 
-	newctrl = ch343->ctrlout;
-	set = (set & TIOCM_DTR ? CH343_CTO_D : 0) |
-	      (set & TIOCM_RTS ? CH343_CTO_R : 0);
-	clear = (clear & TIOCM_DTR ? CH343_CTO_D : 0) |
-		(clear & TIOCM_RTS ? CH343_CTO_R : 0);
+	ms = kmalloc(sizeof(*ms), GFP_KERNEL);
+	if (!ms)
+		return -ENOMEM;
+	if (copy_from_user(ms, arg, sizeof(*ms))) {
+		rv = -EFAULT;
+		goto out_free;
+	}
+	if (!ms->nsteps || ms->nsteps > CH343_SEQ_MAX) {
+		rv = -EINVAL;
+		goto out_free;
+	}
+	for (i = 0; i < ms->nsteps; i++) {
+		if (ms->steps[i].delay_us > CH343_SEQ_DELAY_MAX) {
+			rv = -EINVAL;
+			goto out_free;
+		}
+		hold_us += ms->steps[i].delay_us;
+	}
 
-	newctrl = (newctrl & ~clear) | set;
+	if (!mutex_trylock(&ch343->seq_mutex)) {
+		rv = -EBUSY;
+		goto out_free;
+	}
+	for (i = 0; i < ms->nsteps; i++) {
+		step = &ms->steps[i];
+		seq->ops[i].type = CH343_SEQ_MODEM;
+		seq->ops[i].arg = (step->lines & TIOCM_DTR ? CH343_CTO_D : 0) |
+				  (step->lines & TIOCM_RTS ? CH343_CTO_R : 0);
+		seq->ops[i].delay_us = step->delay_us;
+		seq->ops[i].done_ns = 0;
+		seq->ops[i].elided = false;
+	}
+	seq->nops = ms->nsteps;
 
-	if (ch343->ctrlout == newctrl) {
-		return 0;
+	rv = ch343_seq_run(ch343, hold_us, &ms->total_ns);
+	for (i = 0; i < ms->nsteps; i++) {
+		ms->steps[i].done_ns = seq->ops[i].done_ns;
+		ms->steps[i].flags = seq->ops[i].elided ? CH343_SEQ_ELIDED : 0;
 	}
+	mutex_unlock(&ch343->seq_mutex);
+
+	if (copy_to_user(arg, ms, sizeof(*ms)) && !rv)
+		rv = -EFAULT;
 
-	return ch343_set_control(ch343, ch343->ctrlout = newctrl);
+out_free:
+	kfree(ms);
+	return rv;
 }
 
-static int ch343_get_icount(struct tty_struct *tty,
-			    struct serial_icounter_struct *icount)
+static int ch343_break_frame(struct ch343 *ch343, void __user *arg)
 {
-	struct ch343 *ch343 = tty->driver_data;
-	struct async_icount cnow;
-	unsigned long flags;
+	struct ch343_seq *seq = &ch343->seq;
+	struct ch343_breakframe *bf;
+	u16 value, index;
+	u64 total_ns;
+	int rv;
+
+	bf = kmalloc(sizeof(*bf), GFP_KERNEL);
+	if (!bf)
+		return -ENOMEM;
+	if (copy_from_user(bf, arg, sizeof(*bf))) {
+		rv = -EFAULT;
+		goto out_free;
+	}
+	if (!bf->break_us || bf->break_us > CH343_SEQ_DELAY_MAX ||
+	    bf->mab_us > CH343_SEQ_DELAY_MAX || !bf->len ||
+	    bf->len > CH343_FRAME_MAX || bf->len > ch343->wb_size) {
+		rv = -EINVAL;
+		goto out_free;
+	}
 
-	spin_lock_irqsave(&ch343->read_lock, flags);
-	cnow = ch343->iocount;
-	spin_unlock_irqrestore(&ch343->read_lock, flags);
+	if (!mutex_trylock(&ch343->seq_mutex)) {
+		rv = -EBUSY;
+		goto out_free;
+	}
+	memset(seq->ops, 0, 3 * sizeof(seq->ops[0]));
+	seq->ops[0].type = CH343_SEQ_BREAK;
+	seq->ops[0].arg = 1;
+	seq->ops[0].delay_us = bf->break_us;
+	seq->ops[1].type = CH343_SEQ_BREAK;
+	seq->ops[1].arg = 0;
+	seq->ops[1].delay_us = bf->mab_us;
+	seq->ops[2].type = CH343_SEQ_DATA;
+	seq->nops = 3;
+	seq->data = bf->data;
+	seq->len = bf->len;
+	/* keep tty writes from landing between the break and the payload */
+	spin_lock_irq(&ch343->write_lock);
+	seq->hold_tx = true;
+	spin_unlock_irq(&ch343->write_lock);
 
-	icount->cts = cnow.cts;
-	icount->dsr = cnow.dsr;
-	icount->rng = cnow.rng;
-	icount->dcd = cnow.dcd;
-	icount->tx = cnow.tx;
-	icount->rx = cnow.rx;
-	icount->frame = cnow.frame;
-	icount->parity = cnow.parity;
-	icount->overrun = cnow.overrun;
-	icount->brk = cnow.brk;
-	icount->buf_overrun = cnow.buf_overrun;
+	rv = ch343_seq_run(ch343, (u64)bf->break_us + bf->mab_us, &total_ns);
+	bf->break_ns = seq->ops[0].done_ns;
+	bf->mark_ns = seq->ops[1].done_ns;
+	bf->done_ns = seq->ops[2].done_ns;
+	bf->flags = (seq->ops[0].elided ? CH343_BF_BREAK_ELIDED : 0) |
+		    (seq->ops[1].elided ? CH343_BF_MARK_ELIDED : 0);
+	/*
+	 * A run that failed before the break end completed may have left
+	 * the line in break. The end is queued behind whatever the run
+	 * queued, and the shadow skips it if the break never went out.
+	 * Held writes only go out once it has been applied.
+	 */
+	if (rv < 0 && seq->index < 2) {
+		ch343_break_encode(ch343, 0, &value, &index);
+		if (!ch343_set_state(ch343, CH343_SH_BREAK, CMD_C4, value,
+				     index, CH343_CR_WAIT))
+			bf->flags |= CH343_BF_BREAK_CLEARED;
+	}
+	ch343_seq_release(ch343);
+	seq->data = NULL;
+	mutex_unlock(&ch343->seq_mutex);
 
-	return 0;
+	if (copy_to_user(arg, bf, sizeof(*bf)) && !rv)
+		rv = -EFAULT;
+
+out_free:
+	kfree(bf);
+	return rv;
 }
 
-static int ch343_get_serial_info(struct ch343 *ch343,
-				 struct serial_struct __user *info)
+/*
+ * State of the chip behind a USB device, shared by its interfaces and
+ * found through ch343_chips.
+ */
+static LIST_HEAD(ch343_chips);
+static DEFINE_MUTEX(ch343_chips_lock);
+
+static struct ch343_chip *ch343_chip_get(struct usb_device *dev)
 {
-	struct serial_struct tmp;
+	struct ch343_chip *chip;
 
-	if (!info)
-		return -EINVAL;
+	mutex_lock(&ch343_chips_lock);
+	list_for_each_entry(chip, &ch343_chips, list) {
+		if (chip->dev == dev) {
+			kref_get(&chip->kref);
+			goto out;
+		}
+	}
+	chip = kzalloc(sizeof(*chip), GFP_KERNEL);
+	if (!chip)
+		goto out;
+	kref_init(&chip->kref);
+	mutex_init(&chip->clk_lock);
+	spin_lock_init(&chip->reg_lock);
+	mutex_init(&chip->reg_mutex);
+	chip->dev = usb_get_dev(dev);
+	list_add(&chip->list, &ch343_chips);
+out:
+	mutex_unlock(&ch343_chips_lock);
+	return chip;
+}
 
-	memset(&tmp, 0, sizeof(tmp));
-	tmp.flags = ASYNC_LOW_LATENCY;
-	tmp.xmit_fifo_size = ch343->writesize;
-	tmp.baud_base = le32_to_cpu(ch343->line.dwDTERate);
-	tmp.close_delay = ch343->port.close_delay / 10;
-	tmp.closing_wait = ch343->port.closing_wait ==
-					   ASYNC_CLOSING_WAIT_NONE ?
-				   ASYNC_CLOSING_WAIT_NONE :
-				   ch343->port.closing_wait / 10;
+/* Called with ch343_chips_lock held. */
+static void ch343_chip_release(struct kref *kref)
+{
+	struct ch343_chip *chip = container_of(kref, struct ch343_chip,
+					       kref);
 
-	if (copy_to_user(info, &tmp, sizeof(tmp)))
-		return -EFAULT;
-	else
-		return 0;
+	list_del(&chip->list);
+	usb_put_dev(chip->dev);
+	kfree(chip);
 }
 
-static int ch343_set_serial_info(struct ch343 *ch343,
-				 struct serial_struct __user *newinfo)
+static void ch343_chip_put(struct ch343_chip *chip)
 {
-	struct serial_struct new_serial;
-	unsigned int closing_wait, close_delay;
-	int retval = 0;
-
-	if (copy_from_user(&new_serial, newinfo, sizeof(new_serial)))
-		return -EFAULT;
+	mutex_lock(&ch343_chips_lock);
+	kref_put(&chip->kref, ch343_chip_release);
+	mutex_unlock(&ch343_chips_lock);
+}
 
-	close_delay = new_serial.close_delay * 10;
-	closing_wait = new_serial.closing_wait == ASYNC_CLOSING_WAIT_NONE ?
-			       ASYNC_CLOSING_WAIT_NONE :
-			       new_serial.closing_wait * 10;
+/*
+ * CH9114 and CH346C_M2 derive all ports from one system clock. Above
+ * CH343_CLK_FREE_MAX a port only runs at rates that divide an eighth
+ * of that clock, and re-enabling a port with CMD_C8 lets the device
+ * pick a new clock. The clock state is kept in the shared ch343_chip
+ * so that it is read once and changed only when no port would be left
+ * at a rate the new clock cannot serve.
+ */
+static const u32 ch343_clock_freqs[] = {
+	120000000,
+	96000000,
+	80000000,
+};
 
-	mutex_lock(&ch343->port.mutex);
+static bool ch343_clock_fits(u32 gfreq, unsigned int bval)
+{
+	int i;
 
-	if (!capable(CAP_SYS_ADMIN)) {
-		if ((close_delay != ch343->port.close_delay) ||
-		    (closing_wait != ch343->port.closing_wait))
-			retval = -EPERM;
-		else
-			retval = -EOPNOTSUPP;
-	} else {
-		ch343->port.close_delay = close_delay;
-		ch343->port.closing_wait = closing_wait;
+	if (bval <= CH343_CLK_FREE_MAX)
+		return true;
+	for (i = 0; i < ARRAY_SIZE(ch343_clock_freqs); i++) {
+		if (gfreq == ch343_clock_freqs[i])
+			return !((gfreq / 8) % bval);
 	}
 
-	mutex_unlock(&ch343->port.mutex);
-	return retval;
+	return true;
 }
 
-static int ch343_wait_serial_change(struct ch343 *ch343, unsigned long arg)
+/*
+ * Whether some system clock serves @bval on @port together with the
+ * rates of the other open ports. Called with chip->clk_lock held.
+ */
+static bool ch343_clock_feasible(struct ch343_chip *chip, int port,
+				 unsigned int bval)
 {
-	int rv = 0;
-	DECLARE_WAITQUEUE(wait, current);
-	struct async_icount old, new;
+	int i, j;
 
-	do {
-		spin_lock_irq(&ch343->read_lock);
-		old = ch343->oldcount;
-		new = ch343->iocount;
-		ch343->oldcount = new;
-		spin_unlock_irq(&ch343->read_lock);
+	for (i = 0; i < ARRAY_SIZE(ch343_clock_freqs); i++) {
+		if (!ch343_clock_fits(ch343_clock_freqs[i], bval))
+			continue;
+		for (j = 0; j < CH343_CLK_PORTS; j++) {
+			if (j != port && chip->rate[j] &&
+			    !ch343_clock_fits(ch343_clock_freqs[i],
+					      chip->rate[j]))
+				break;
+		}
+		if (j == CH343_CLK_PORTS)
+			return true;
+	}
 
-		if ((arg & TIOCM_CTS) && old.cts != new.cts)
-			break;
-		if ((arg & TIOCM_DSR) && old.dsr != new.dsr)
-			break;
-		if ((arg & TIOCM_RI) && old.rng != new.rng)
-			break;
-		if ((arg & TIOCM_CD) && old.dcd != new.dcd)
-			break;
+	return false;
+}
 
-		add_wait_queue(&ch343->wioctl, &wait);
-		set_current_state(TASK_INTERRUPTIBLE);
-		schedule();
-		remove_wait_queue(&ch343->wioctl, &wait);
-		if (ch343->disconnected) {
-			if (arg & TIOCM_CD)
-				break;
-			else
-				rv = -ENODEV;
+/*
+ * Read the system clock. A set change flag means the device is free to
+ * switch clocks, in that case the result is not kept. Called with
+ * chip->clk_lock held.
+ */
+static int ch343_clock_read(struct ch343 *ch343)
+{
+	struct ch343_chip *chip = ch343->chip;
+	const unsigned size = 8;
+	char *buffer;
+	int r;
+
+	buffer = kmalloc(size, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	r = ch343_control_in(ch343, CMD_C7, 0x01, 0, buffer, size);
+	if (r < 5) {
+		chip->clk_valid = false;
+		r = r < 0 ? r : -EIO;
+		goto out;
+	}
+	chip->gfreq = get_unaligned_le32(buffer);
+	chip->change = buffer[4];
+	chip->clk_valid = !chip->change;
+	r = 0;
+
+out:
+	kfree(buffer);
+	return r;
+}
+
+/* Forget the clock after a port was enabled or disabled. */
+static void ch343_clock_invalidate(struct ch343 *ch343, bool closed)
+{
+	struct ch343_chip *chip = ch343->chip;
+
+	mutex_lock(&chip->clk_lock);
+	chip->clk_valid = false;
+	if (closed)
+		chip->rate[ch343->iface] = 0;
+	mutex_unlock(&chip->clk_lock);
+}
+
+/*
+ * Make sure the system clock can serve @bval on this port, switching it
+ * if every open port can run from another clock.
+ */
+static int ch343_clock_set(struct ch343 *ch343, unsigned int bval)
+{
+	struct ch343_chip *chip = ch343->chip;
+	int r = 0;
+
+	mutex_lock(&chip->clk_lock);
+	if (bval <= CH343_CLK_FREE_MAX)
+		goto done;
+
+	if (!chip->clk_valid) {
+		r = ch343_clock_read(ch343);
+		if (r)
+			goto out;
+	}
+	if (chip->change || ch343_clock_fits(chip->gfreq, bval))
+		goto done;
+
+	if (!ch343_clock_feasible(chip, ch343->iface, bval)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	chip->clk_valid = false;
+	r = ch343_set_state(ch343, CH343_SH_PORT, CMD_C8,
+			    0x02 | (ch343->iface << 8), 0x00, CH343_CR_WAIT);
+	if (!r)
+		r = ch343_set_state(ch343, CH343_SH_PORT, CMD_C8,
+				    0x01 | (ch343->iface << 8), 0x00,
+				    CH343_CR_WAIT);
+	if (r) {
+		dev_err(&ch343->control->dev, "%s - failed: %d\n", __func__,
+			r);
+		goto out;
+	}
+	r = ch343_clock_read(ch343);
+	if (r)
+		goto out;
+	if (!chip->change && !ch343_clock_fits(chip->gfreq, bval)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+done:
+	chip->rate[ch343->iface] = bval;
+out:
+	mutex_unlock(&chip->clk_lock);
+	return r;
+}
+
+/*
+ * Vendor registers are accessed in pairs, CMD_R and CMD_W carry two
+ * addresses in wValue and CMD_W the two values in wIndex. The register
+ * file belongs to the chip, so the cache lives in ch343_chip and every
+ * port sees the same one. Registers the hardware changes on its own are
+ * never cached.
+ */
+static const u8 ch343_volatile_regs[] = {
+	0x06, 0x07, /* modem and line status */
+	0x12, 0x13, /* divisor, rewritten by autobaud */
+};
+
+static bool ch343_reg_volatile(unsigned int reg)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ch343_volatile_regs); i++) {
+		if (ch343_volatile_regs[i] == reg)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Cache a value read from or written to the device, unless the cache
+ * was dropped since @gen was sampled.
+ */
+static void ch343_reg_store(struct ch343_chip *chip, unsigned long gen,
+			    unsigned int reg, u8 val)
+{
+	spin_lock_irq(&chip->reg_lock);
+	if (gen == chip->reg_gen && !ch343_reg_volatile(reg)) {
+		chip->regs[reg] = val;
+		set_bit(reg, chip->reg_valid);
+	}
+	spin_unlock_irq(&chip->reg_lock);
+}
+
+static bool ch343_regs_overlap(unsigned int start, unsigned int count,
+			       const u8 *regs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (regs[i] >= start && regs[i] < start + count)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * A raw write to the line coding or break registers changes what the
+ * device holds behind the shadow slots, so set_termios and break_ctl
+ * must send their next request even when the settings look unchanged.
+ */
+static void ch343_regs_forget_state(struct ch343 *ch343, unsigned int start,
+				    unsigned int count)
+{
+	bool line, brk;
+
+	line = ch343_regs_overlap(start, count, ch343_line_regs,
+				  ARRAY_SIZE(ch343_line_regs));
+	brk = ch343_regs_overlap(start, count, ch343_break_regs,
+				 ARRAY_SIZE(ch343_break_regs));
+	if (!line && !brk)
+		return;
+
+	spin_lock_irq(&ch343->write_lock);
+	if (line) {
+		ch343->shadow[CH343_SH_LINE].valid = false;
+		ch343->termios_valid = false;
+	}
+	if (brk)
+		ch343->shadow[CH343_SH_BREAK].valid = false;
+	spin_unlock_irq(&ch343->write_lock);
+}
+
+/*
+ * Read @count registers starting at @start. Cached registers cost no
+ * transfer unless @nocache is set, the others are fetched two at a time.
+ */
+static int ch343_regs_read(struct ch343 *ch343, unsigned int start,
+			   u8 *buf, unsigned int count, bool nocache)
+{
+	struct ch343_chip *chip = ch343->chip;
+	unsigned int i, reg, reg2;
+	unsigned long gen;
+	bool cached;
+	u8 data[2];
+	int rv = 0;
+
+	if (start + count > CH343_NREGS)
+		return -EINVAL;
+
+	mutex_lock(&chip->reg_mutex);
+	for (i = 0; i < count; i++) {
+		reg = start + i;
+		spin_lock_irq(&chip->reg_lock);
+		cached = !nocache && test_bit(reg, chip->reg_valid);
+		if (cached) {
+			buf[i] = chip->regs[reg];
+			chip->reg_hits++;
 		} else {
-			if (signal_pending(current))
-				rv = -ERESTARTSYS;
+			chip->reg_fetches++;
+		}
+		gen = chip->reg_gen;
+		spin_unlock_irq(&chip->reg_lock);
+		if (cached)
+			continue;
+
+		reg2 = i + 1 < count ? reg + 1 : reg;
+		rv = ch343_control_in(ch343, CMD_R, reg | (reg2 << 8), 0,
+				      data, 2);
+		if (rv < 0)
+			goto out;
+		if (rv < 2) {
+			rv = -EIO;
+			goto out;
+		}
+		buf[i] = data[0];
+		ch343_reg_store(chip, gen, reg, data[0]);
+		if (reg2 != reg) {
+			buf[++i] = data[1];
+			ch343_reg_store(chip, gen, reg2, data[1]);
 		}
-	} while (!rv);
+	}
+	rv = 0;
 
+out:
+	mutex_unlock(&chip->reg_mutex);
 	return rv;
 }
 
-static int
-ch343_get_serial_usage(struct ch343 *ch343,
-		       struct serial_icounter_struct __user *count)
+/* Write @count registers starting at @start, two per transfer. */
+static int ch343_regs_write(struct ch343 *ch343, unsigned int start,
+			    const u8 *buf, unsigned int count)
 {
-	struct serial_icounter_struct icount;
+	struct ch343_chip *chip = ch343->chip;
+	unsigned int i, reg, reg2;
+	unsigned long gen;
+	u8 val2;
 	int rv = 0;
 
-	memset(&icount, 0, sizeof(icount));
-	icount.cts = ch343->iocount.cts;
-	icount.dsr = ch343->iocount.dsr;
-	icount.rng = ch343->iocount.rng;
-	icount.dcd = ch343->iocount.dcd;
-	icount.tx = ch343->iocount.tx;
-	icount.rx = ch343->iocount.rx;
-	icount.frame = ch343->iocount.frame;
-	icount.overrun = ch343->iocount.overrun;
-	icount.parity = ch343->iocount.parity;
-	icount.brk = ch343->iocount.brk;
-	icount.buf_overrun = ch343->iocount.buf_overrun;
+	if (start + count > CH343_NREGS)
+		return -EINVAL;
 
-	if (copy_to_user(count, &icount, sizeof(icount)) > 0)
-		rv = -EFAULT;
+	mutex_lock(&chip->reg_mutex);
+	for (i = 0; i < count; i += 2) {
+		reg = start + i;
+		if (i + 1 < count) {
+			reg2 = reg + 1;
+			val2 = buf[i + 1];
+		} else {
+			reg2 = reg;
+			val2 = buf[i];
+		}
+		spin_lock_irq(&chip->reg_lock);
+		gen = chip->reg_gen;
+		spin_unlock_irq(&chip->reg_lock);
+
+		rv = ch343_control_out(ch343, CMD_W, reg | (reg2 << 8),
+				       buf[i] | (val2 << 8));
+		if (rv < 0) {
+			/* the device may hold either value now */
+			spin_lock_irq(&chip->reg_lock);
+			clear_bit(reg, chip->reg_valid);
+			clear_bit(reg2, chip->reg_valid);
+			spin_unlock_irq(&chip->reg_lock);
+			goto out;
+		}
+		ch343_reg_store(chip, gen, reg, buf[i]);
+		ch343_reg_store(chip, gen, reg2, val2);
+	}
+	rv = 0;
 
+out:
+	mutex_unlock(&chip->reg_mutex);
+	ch343_regs_forget_state(ch343, start, count);
 	return rv;
 }
 
-static int ch343_tty_ioctl(struct tty_struct *tty, unsigned int cmd,
-			   unsigned long arg)
+static inline int ch343_set_line(struct ch343 *ch343,
+				 struct usb_cdc_line_coding *line)
 {
-	struct ch343 *ch343 = tty->driver_data;
-	int rv = 0;
-	unsigned long arg1, arg2, arg3, arg4, arg5, arg6;
-	u32 __user *argval = (u32 __user *)arg;
-	u8 *buffer;
+	return 0;
+}
 
-	buffer = kmalloc(512, GFP_KERNEL);
+#define CH343_CI_PORTED (CH343_CI_STATUS_PORT | CH343_CI_BREAK_PORT)
+#define CH343_CI_FAST (CH343_CI_PORTED | CH343_CI_BAUD_MHZ)
+
+static const struct ch343_chipinfo ch343_chipinfo[] = {
+	[CHIP_CH342F] = { "CH342F", 0, 0 },
+	[CHIP_CH342K] = { "CH342K", 0, 0 },
+	[CHIP_CH343GP] = { "CH343GP", 0, 0 },
+	[CHIP_CH343G_AUTOBAUD] = { "CH343G_AUTOBAUD", CH343_CI_AUTOBAUD, 0 },
+	[CHIP_CH343K] = { "CH343K", 0, 0 },
+	[CHIP_CH343J] = { "CH343J", 0, 0 },
+	[CHIP_CH344L] = { "CH344L",
+			  CH343_CI_PORTED | CH343_CI_STATUS_PORT0 |
+				  CH343_CI_STATUS_CTS,
+			  0 },
+	[CHIP_CH344L_V2] = { "CH344L_V2",
+			     CH343_CI_PORTED | CH343_CI_STATUS_CTS, 0 },
+	[CHIP_CH344Q] = { "CH344Q", CH343_CI_PORTED, 0 },
+	[CHIP_CH347TF] = { "CH347TF", CH343_CI_PORTED, 358401 },
+	[CHIP_CH9101UH] = { "CH9101UH", 0, 0 },
+	[CHIP_CH9101RY] = { "CH9101RY", 0, 0 },
+	[CHIP_CH9102F] = { "CH9102F", 0, 0 },
+	[CHIP_CH9102X] = { "CH9102X", 0, 0 },
+	[CHIP_CH9103M] = { "CH9103M", 0, 0 },
+	[CHIP_CH9104L] = { "CH9104L", CH343_CI_PORTED, 0 },
+	[CHIP_CH340B] = { "CH340B", 0, 0 },
+	[CHIP_CH339W] = { "CH339W", CH343_CI_PORTED, 0 },
+	[CHIP_CH9111L_M0] = { "CH9111L_M0", CH343_CI_FAST, 2000000 },
+	[CHIP_CH9111L_M1] = { "CH9111L_M1", CH343_CI_FAST, 2000000 },
+	[CHIP_CH9114L] = { "CH9114L",
+			   CH343_CI_FAST | CH343_CI_CLOCK | CH343_CI_PORT_EN,
+			   2000000 },
+	[CHIP_CH9114W] = { "CH9114W",
+			   CH343_CI_FAST | CH343_CI_CLOCK | CH343_CI_PORT_EN,
+			   2000000 },
+	[CHIP_CH9114F] = { "CH9114F",
+			   CH343_CI_FAST | CH343_CI_CLOCK | CH343_CI_PORT_EN,
+			   2000000 },
+	[CHIP_CH346C_M0] = { "CH346C_M0", CH343_CI_FAST, 2000000 },
+	[CHIP_CH346C_M1] = { "CH346C_M1", CH343_CI_FAST, 2000000 },
+	[CHIP_CH346C_M2] = { "CH346C_M2",
+			     CH343_CI_FAST | CH343_CI_CLOCK |
+				     CH343_CI_PORT_EN,
+			     2000000 },
+};
+
+static int ch343_configure(struct ch343 *ch343)
+{
+	char *buffer;
+	int r;
+	const unsigned size = 8;
+	u8 chiptype;
+	u8 chipver;
+
+	buffer = kmalloc(size, GFP_KERNEL);
 	if (!buffer)
 		return -ENOMEM;
 
-	switch (cmd) {
-	case TIOCGSERIAL: /* gets serial port data */
-		rv = ch343_get_serial_info(
-			ch343, (struct serial_struct __user *)arg);
+	r = ch343_control_in(ch343, CMD_C6, 0, 0, buffer, size);
+	if (r <= 0)
+		goto out;
+
+	chipver = buffer[0];
+	chiptype = buffer[1];
+	ch343->iosupport = true;
+
+	switch (ch343->idProduct) {
+	case 0x55D2:
+		ch343->num_ports = 2;
+		if (chiptype == 0x41)
+			ch343->chiptype = CHIP_CH342K;
+		else
+			ch343->chiptype = CHIP_CH342F;
+		if (chiptype != 0x48 || chipver < 0x45)
+			ch343->iosupport = false;
 		break;
-	case TIOCSSERIAL:
-		rv = ch343_set_serial_info(
-			ch343, (struct serial_struct __user *)arg);
+	case 0x55D3:
+		ch343->num_ports = 1;
+		if (chiptype == 0x02)
+			ch343->chiptype = CHIP_CH343J;
+		else if (chiptype == 0x01)
+			ch343->chiptype = CHIP_CH343K;
+		else if (chiptype == 0x18)
+			ch343->chiptype = CHIP_CH343G_AUTOBAUD;
+		else
+			ch343->chiptype = CHIP_CH343GP;
+		ch343->iosupport = false;
 		break;
-	case TIOCMIWAIT:
-		rv = usb_autopm_get_interface(ch343->control);
-		if (rv < 0) {
-			rv = -EIO;
-			break;
-		}
-		rv = ch343_wait_serial_change(ch343, arg);
-		usb_autopm_put_interface(ch343->control);
+	case 0x55D4:
+		ch343->num_ports = 1;
+		if (chiptype == 0x09)
+			ch343->chiptype = CHIP_CH9102X;
+		else
+			ch343->chiptype = CHIP_CH9102F;
 		break;
-	case TIOCGICOUNT:
-		rv = ch343_get_serial_usage(
-			ch343,
-			(struct serial_icounter_struct __user *)arg);
+	case 0x55D5:
+		ch343->num_ports = 4;
+		if (chiptype == 0xC0) {
+			if ((buffer[0] & 0xF0) == 0x40)
+				ch343->chiptype = CHIP_CH344L;
+			else
+				ch343->chiptype = CHIP_CH344L_V2;
+		} else
+			ch343->chiptype = CHIP_CH344Q;
 		break;
-	case IOCTL_CMD_GETCHIPTYPE:
-		if (put_user(ch343->chiptype, argval)) {
-			rv = -EFAULT;
-			goto out;
-		}
+	case 0x55D7:
+		ch343->num_ports = 2;
+		ch343->chiptype = CHIP_CH9103M;
 		break;
-	case IOCTL_CMD_GETUARTINDEX:
-		if (put_user(ch343->iface, argval)) {
-			rv = -EFAULT;
-			goto out;
-		}
+	case 0x55D8:
+		ch343->num_ports = 1;
+		if (chiptype == 0x0A)
+			ch343->chiptype = CHIP_CH9101RY;
+		else
+			ch343->chiptype = CHIP_CH9101UH;
 		break;
-	case IOCTL_CMD_CTRLIN:
-		get_user(arg1, (u8 __user *)arg);
-		get_user(arg2, ((u8 __user *)arg + 1));
-		get_user(arg3, (u16 __user *)((u8 *)arg + 2));
-		get_user(arg4, (u16 __user *)((u8 *)arg + 4));
-		get_user(arg5, (u16 __user *)((u8 *)arg + 6));
-		arg6 = (unsigned long)((u8 __user *)arg + 8);
-		rv = ch343_control_msg_in(ch343, (u8)arg1, (u8)arg2,
-					  (u16)arg3, (u16)arg4,
-					  (u8 __user *)arg6, (u16)arg5);
+	case 0x55DB:
+	case 0x55DD:
+		ch343->num_ports = 1;
+		ch343->chiptype = CHIP_CH347TF;
 		break;
-	case IOCTL_CMD_CTRLOUT:
-		get_user(arg1, (u8 __user *)arg);
-		get_user(arg2, ((u8 __user *)arg + 1));
-		get_user(arg3, (u16 __user *)((u8 *)arg + 2));
-		get_user(arg4, (u16 __user *)((u8 *)arg + 4));
-		get_user(arg5, (u16 __user *)((u8 *)arg + 6));
-		arg6 = (unsigned long)((u8 __user *)arg + 8);
-		rv = ch343_control_msg_out(ch343, (u8)arg1, (u8)arg2,
-					   (u16)arg3, (u16)arg4,
-					   (u8 __user *)arg6, (u16)arg5);
-		if (rv != (u16)arg5) {
-			rv = -EINVAL;
-			goto out;
-		}
+	case 0x55DA:
+	case 0x55DE:
+		ch343->num_ports = 2;
+		ch343->chiptype = CHIP_CH347TF;
+		break;
+	case 0x55E7:
+		ch343->num_ports = 1;
+		ch343->chiptype = CHIP_CH339W;
+		ch343->iosupport = false;
+		break;
+	case 0x55DF:
+		ch343->num_ports = 4;
+		ch343->chiptype = CHIP_CH9104L;
+		break;
+	case 0x55E9:
+		ch343->num_ports = 1;
+		ch343->chiptype = CHIP_CH9111L_M0;
+		break;
+	case 0x55EA:
+		ch343->num_ports = 1;
+		ch343->chiptype = CHIP_CH9111L_M1;
+		break;
+	case 0x55E8:
+		ch343->num_ports = 4;
+		chiptype = buffer[2];
+		if (chiptype == 0x48)
+			ch343->chiptype = CHIP_CH9114L;
+		else if (chiptype == 0x49)
+			ch343->chiptype = CHIP_CH9114W;
+		else if (chiptype == 0x4A)
+			ch343->chiptype = CHIP_CH9114F;
+		break;
+	case 0x55EB:
+		ch343->num_ports = 1;
+		if (buffer[4] & 0x01)
+			ch343->chiptype = CHIP_CH346C_M1;
+		else
+			ch343->chiptype = CHIP_CH346C_M0;
+		break;
+	case 0x55EC:
+		ch343->num_ports = 2;
+		ch343->chiptype = CHIP_CH346C_M2;
 		break;
 	default:
-		rv = -ENOIOCTLCMD;
 		break;
 	}
+
 out:
+	ch343->info = &ch343_chipinfo[ch343->chiptype];
 	kfree(buffer);
-	return rv;
+	return r < 0 ? r : 0;
+}
+
+static int ch343_wb_alloc(struct ch343 *ch343)
+{
+	int i, wbn;
+	struct ch343_wb *wb;
+
+	wbn = 0;
+	i = 0;
+	for (;;) {
+		wb = &ch343->wb[wbn];
+		if (!wb->use) {
+			wb->use = 1;
+			return wbn;
+		}
+		wbn = (wbn + 1) % CH343_NW;
+		if (++i >= CH343_NW)
+			return -1;
+	}
+}
+
+static int ch343_wb_is_avail(struct ch343 *ch343)
+{
+	int i, n;
+	unsigned long flags;
+
+	n = CH343_NW;
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	for (i = 0; i < CH343_NW; i++)
+		n -= ch343->wb[i].use;
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
+	return n;
+}
+
+/*
+ * Token bucket for transmit pacing, tokens are kept in bytes scaled by
+ * NSEC_PER_SEC so that refilling needs no division. Returns the number of
+ * bytes of count that may be sent now, or 0 after arming tx_timer to wake
+ * the writer once enough tokens have accumulated.
+ * Called with write_lock held.
+ */
+static int ch343_tx_pace(struct ch343 *ch343, int count)
+{
+	ktime_t now;
+	s64 elapsed;
+	u64 full;
+	u64 avail;
+	u64 want;
+
+	if (!ch343->tx_rate)
+		return count;
+
+	now = ktime_get();
+	elapsed = ktime_to_ns(ktime_sub(now, ch343->tx_stamp));
+	ch343->tx_stamp = now;
+
+	full = (u64)ch343->tx_burst * NSEC_PER_SEC;
+	if (elapsed > 0)
+		ch343->tx_tokens += (u64)ch343->tx_rate *
+				    min_t(u64, elapsed, 60 * NSEC_PER_SEC);
+	if (ch343->tx_tokens > full)
+		ch343->tx_tokens = full;
+
+	/* send in chunks of at least one bucket, unless the write is smaller */
+	want = min_t(u64, count, ch343->tx_burst);
+	avail = div_u64(ch343->tx_tokens, NSEC_PER_SEC);
+	if (avail >= want) {
+		count = min_t(u64, count, avail);
+		ch343->tx_tokens -= (u64)count * NSEC_PER_SEC;
+		return count;
+	}
+
+	want = want * NSEC_PER_SEC - ch343->tx_tokens;
+	hrtimer_start(&ch343->tx_timer,
+		      ns_to_ktime(div_u64(want + ch343->tx_rate - 1,
+					  ch343->tx_rate)),
+		      HRTIMER_MODE_REL);
+	return 0;
+}
+
+static enum hrtimer_restart ch343_tx_timer(struct hrtimer *timer)
+{
+	struct ch343 *ch343 = container_of(timer, struct ch343, tx_timer);
+
+	schedule_work(&ch343->work);
+	return HRTIMER_NORESTART;
+}
+
+static int ch343_set_tx_rate(struct ch343 *ch343, u32 rate, u32 burst)
+{
+	unsigned long flags;
+
+	if (rate > CH343_TX_RATE_MAX || burst > CH343_TX_BURST_MAX)
+		return -EINVAL;
+	if (rate && !burst)
+		return -EINVAL;
+
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	ch343->tx_rate = rate;
+	if (burst)
+		ch343->tx_burst = burst;
+	ch343->tx_tokens = (u64)ch343->tx_burst * NSEC_PER_SEC;
+	ch343->tx_stamp = ktime_get();
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
+
+	/* a writer waiting for tokens may proceed under the new limits */
+	hrtimer_cancel(&ch343->tx_timer);
+	schedule_work(&ch343->work);
+
+	return 0;
+}
+
+/*
+ * The write path takes a single autopm reference when it becomes busy and
+ * keeps it until the queue has been idle for CH343_TX_PM_IDLE ms, instead
+ * of a get/put pair per URB.
+ */
+static void ch343_tx_pm_idle(struct work_struct *work)
+{
+	struct ch343 *ch343 = container_of(to_delayed_work(work),
+					   struct ch343, tx_pm_work);
+	unsigned long idle = msecs_to_jiffies(CH343_TX_PM_IDLE);
+	bool put = false;
+	int i;
+
+	spin_lock_irq(&ch343->write_lock);
+	if (!ch343->tx_pm_held)
+		goto out;
+	for (i = 0; i < CH343_NW; i++) {
+		if (ch343->wb[i].use)
+			goto out;
+	}
+	if (time_before(jiffies, ch343->tx_last + idle)) {
+		schedule_delayed_work(&ch343->tx_pm_work,
+				      ch343->tx_last + idle - jiffies);
+		goto out;
+	}
+	ch343->tx_pm_held = false;
+	put = true;
+out:
+	spin_unlock_irq(&ch343->write_lock);
+
+	if (put) {
+		usb_mark_last_busy(ch343->dev);
+		usb_autopm_put_interface_async(ch343->control);
+	}
+}
+
+static void ch343_tx_pm_release(struct ch343 *ch343)
+{
+	bool put;
+
+	cancel_delayed_work_sync(&ch343->tx_pm_work);
+
+	spin_lock_irq(&ch343->write_lock);
+	put = ch343->tx_pm_held;
+	ch343->tx_pm_held = false;
+	spin_unlock_irq(&ch343->write_lock);
+
+	if (put)
+		usb_autopm_put_interface_async(ch343->control);
+}
+
+/*
+ * Pick the write urb fill size so that a full urb lasts about
+ * CH343_TX_TARGET_MS on the wire at the current line coding, keeping
+ * flush and close responsive at low rates and the bus busy at high ones.
+ */
+static void ch343_update_writesize(struct ch343 *ch343)
+{
+	unsigned long flags;
+	unsigned int size;
+	unsigned int bits;
+
+	if (ch343->tx_urb_size) {
+		size = ch343->tx_urb_size;
+	} else {
+		bits = 1 + ch343->line.bDataBits + ch343->line.bCharFormat +
+		       (ch343->line.bParityType ? 1 : 0);
+		size = div_u64((u64)ch343->line.dwDTERate * CH343_TX_TARGET_MS,
+			       bits * MSEC_PER_SEC);
+	}
+	size = roundup(size, ch343->tx_maxp);
+	size = clamp_t(unsigned int, size, ch343->tx_maxp, ch343->wb_size);
+
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	ch343->writesize = size;
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
+}
+
+/*
+ * Time the chip needs to send @bytes at the current line settings. Once
+ * the last urb has completed its data may still sit in the chip fifo,
+ * with urbs sized to the line rate that is at most about one urb.
+ */
+static u64 ch343_tx_drain_ns(struct ch343 *ch343, unsigned int bytes)
+{
+	struct usb_ch343_line_coding *line = &ch343->line;
+	unsigned int bits, rate;
+
+	rate = ch343->baud_actual ? ch343->baud_actual : line->dwDTERate;
+	if (!rate)
+		return 0;
+	bits = 1 + line->bDataBits + (line->bParityType ? 1 : 0) +
+	       (line->bCharFormat == 2 ? 2 : 1);
+
+	/* one extra character for the one in the shift register */
+	return div_u64((u64)(bytes + 1) * bits * NSEC_PER_SEC, rate);
+}
+
+static void ch343_write_done(struct ch343 *ch343, struct ch343_wb *wb)
+{
+	ktime_t now;
+
+	wb->use = 0;
+	if (ch343->tx_ordered) {
+		/*
+		 * Bytes of an earlier urb may still sit in the chip fifo,
+		 * so each urb adds to the drain time rather than restarting
+		 * it.
+		 */
+		now = ktime_get();
+		if (ktime_before(ch343->tx_drained, now))
+			ch343->tx_drained = now;
+		ch343->tx_drained = ktime_add_ns(ch343->tx_drained,
+						 wb->drain_ns);
+	}
+	if (--ch343->transmitting)
+		return;
+	if (ch343->tx_pm_held) {
+		ch343->tx_last = jiffies;
+		schedule_delayed_work(&ch343->tx_pm_work,
+				      msecs_to_jiffies(CH343_TX_PM_IDLE));
+	}
+	if (ch343->tx_ordered && ch343->cr_barriers)
+		ch343_cr_kick(ch343);
+}
+
+static const char *const ch343_tr_dirs[CH343_TR_DIRS] = {
+	[CH343_TR_RX] = "rx",
+	[CH343_TR_TX] = "tx",
+	[CH343_TR_STATUS] = "status",
+};
+
+/*
+ * Instrumentation of a completed urb, only reached through the
+ * ch343_tr_any branch. since is the submission time of a stamped tx
+ * urb, 0 if it was not stamped.
+ */
+static noinline void ch343_trace_urb(struct ch343 *ch343, int dir,
+				     struct urb *urb, ktime_t since)
+{
+	struct ch343_trace *tr = &ch343->trace[dir];
+	unsigned int len = urb->actual_length;
+	unsigned long flags;
+	struct device *dev;
+	ktime_t now;
+	u32 us;
+
+	/* urbs killed on close or suspend are not traffic */
+	if (urb->status == -ENOENT || urb->status == -ECONNRESET ||
+	    urb->status == -ESHUTDOWN)
+		return;
+
+	if (!urb->status && ch343_traced(payload) && len) {
+		dev = dir == CH343_TR_STATUS ? &ch343->control->dev :
+					       &ch343->data->dev;
+		dev_printk(KERN_DEBUG, dev, "%s %u: %*ph%s\n",
+			   ch343_tr_dirs[dir], len, (int)min(len, 64U),
+			   urb->transfer_buffer, len > 64 ? " ..." : "");
+	}
+
+	now = ktime_get();
+	spin_lock_irqsave(&ch343->trace_lock, flags);
+	if (ch343_traced(stats)) {
+		tr->urbs++;
+		if (urb->status)
+			tr->errors++;
+		else if (dir == CH343_TR_TX &&
+			 len != urb->transfer_buffer_length)
+			tr->shorts++;
+	}
+	if (urb->status)
+		goto out;
+
+	if (ch343_traced(hist))
+		tr->size_hist[min(fls(len), CH343_TR_BUCKETS - 1)]++;
+
+	if (!ch343_traced(stamps))
+		goto out;
+	if (dir != CH343_TR_TX) {
+		since = tr->last;
+		tr->last = now;
+	}
+	if (!ktime_to_ns(since))
+		goto out;
+	us = (u32)ktime_us_delta(now, since);
+	tr->count++;
+	tr->sum_us += us;
+	if (tr->count == 1 || us < tr->min_us)
+		tr->min_us = us;
+	if (us > tr->max_us)
+		tr->max_us = us;
+	if (ch343_traced(hist))
+		tr->time_hist[min(fls(us), CH343_TR_BUCKETS - 1)]++;
+out:
+	spin_unlock_irqrestore(&ch343->trace_lock, flags);
+}
+
+static int ch343_start_wb(struct ch343 *ch343, struct ch343_wb *wb)
+{
+	int rc;
+
+	ch343->transmitting++;
+
+	wb->ticket = 0;
+	wb->stamped = false;
+	if (ch343->txts.open) {
+		/* 0 marks an unstamped urb */
+		if (!++ch343->tx_ticket)
+			ch343->tx_ticket++;
+		wb->ticket = ch343->tx_ticket;
+	}
+	if (wb->ticket || ch343_traced(stamps)) {
+		wb->submit = ktime_get();
+		wb->stamped = true;
+	}
+
+	wb->urb->transfer_buffer = wb->buf;
+	wb->urb->transfer_dma = wb->dmah;
+	wb->urb->transfer_buffer_length = wb->len;
+	wb->urb->dev = ch343->dev;
+
+	rc = usb_submit_urb(wb->urb, GFP_ATOMIC);
+	if (rc < 0) {
+		dev_err(&ch343->data->dev,
+			"%s - usb_submit_urb(write bulk) failed: %d\n",
+			__func__, rc);
+		/* nothing reached the chip fifo */
+		wb->drain_ns = 0;
+		ch343_write_done(ch343, wb);
+	}
+	return rc;
+}
+
+/*
+ * PPS source on DCD or CTS. Edges are stamped when the status urb
+ * completes, so the jitter is that of the interrupt endpoint polling
+ * rather than of waking a task blocked in TIOCMIWAIT. ch343->pps and
+ * pps_line change under read_lock, which the status handler holds
+ * while it reports an edge.
+ */
+#if IS_ENABLED(CONFIG_PPS)
+static int ch343_pps_set(struct ch343 *ch343, unsigned int line)
+{
+	struct pps_source_info info;
+	struct pps_device *pps = NULL, *old;
+
+	if (line) {
+		memset(&info, 0, sizeof(info));
+		snprintf(info.name, sizeof(info.name), "ttyCH343USB%d",
+			 ch343->minor);
+		snprintf(info.path, sizeof(info.path), "/dev/ttyCH343USB%d",
+			 ch343->minor);
+		info.mode = PPS_CAPTUREBOTH | PPS_OFFSETASSERT |
+			    PPS_OFFSETCLEAR | PPS_CANWAIT | PPS_TSFMT_TSPEC;
+		info.owner = THIS_MODULE;
+		info.dev = &ch343->control->dev;
+		pps = pps_register_source(&info, PPS_CAPTUREASSERT |
+							 PPS_OFFSETASSERT);
+		if (IS_ERR_OR_NULL(pps))
+			return pps ? PTR_ERR(pps) : -ENOMEM;
+	}
+
+	spin_lock_irq(&ch343->read_lock);
+	old = ch343->pps;
+	ch343->pps = pps;
+	ch343->pps_line = line;
+	spin_unlock_irq(&ch343->read_lock);
+
+	if (old)
+		pps_unregister_source(old);
+
+	return 0;
+}
+
+/* Called with read_lock held. */
+static void ch343_pps_event(struct ch343 *ch343, struct pps_event_time *ts,
+			    u8 status)
+{
+	pps_event(ch343->pps, ts,
+		  status & ch343->pps_line ? PPS_CAPTUREASSERT :
+					     PPS_CAPTURECLEAR,
+		  NULL);
+}
+#else
+static int ch343_pps_set(struct ch343 *ch343, unsigned int line)
+{
+	return line ? -EOPNOTSUPP : 0;
+}
+#endif
+
+/* TIOCM_* bits of the CH343_CTI_* input lines @ctrlin. */
+static unsigned int ch343_lines_in(unsigned int ctrlin)
+{
+	return (ctrlin & CH343_CTI_C ? TIOCM_CTS : 0) |
+	       (ctrlin & CH343_CTI_DS ? TIOCM_DSR : 0) |
+	       (ctrlin & CH343_CTI_R ? TIOCM_RI : 0) |
+	       (ctrlin & CH343_CTI_DC ? TIOCM_CD : 0);
+}
+
+/*
+ * Queues a modem event, called from the status urb completion only so
+ * mev_seq and mev_lost need no lock.
+ */
+static void ch343_mev_push(struct ch343 *ch343, ktime_t now, u8 old_in,
+			   u8 new_in, u32 errors)
+{
+	struct ch343_modemev ev;
+
+	if (!READ_ONCE(ch343->mev.open))
+		return;
+
+	/* the queue opened after the packet was first looked at */
+	if (!ktime_to_ns(now))
+		now = ktime_get();
+	ev.time_ns = ktime_to_ns(now);
+	ev.seq = ch343->mev_seq++;
+	ev.lost = ch343->mev_lost;
+	ev.old_lines = ch343_lines_in(old_in);
+	ev.new_lines = ch343_lines_in(new_in);
+	ev.errors = errors;
+	if (ch343_evq_push(&ch343->mev, &ev))
+		ch343->mev_lost = 0;
+	else
+		ch343->mev_lost++;
+}
+
+static void ch343_update_status(struct ch343 *ch343, unsigned char *data,
+				size_t len)
+{
+	unsigned long flags;
+	u8 status;
+	u8 difference;
+	u8 type = data[0];
+	u8 handled = 0;
+	ktime_t now = ktime_set(0, 0);
+	unsigned long lines;
+	u8 old_in, new_in;
+	u32 errors = 0;
+	bool baseline;
+#if IS_ENABLED(CONFIG_PPS)
+	struct pps_event_time ts;
+	bool stamped = READ_ONCE(ch343->pps_line);
+
+	/* stamp before anything else, an edge may be in this packet */
+	if (stamped)
+		pps_get_ts(&ts);
+#endif
+	/* only a modem event reader needs the time */
+	if (READ_ONCE(ch343->mev.open))
+		now = ktime_get();
+
+	if (len < 4)
+		return;
+
+	if (ch343->info->flags & CH343_CI_STATUS_PORT) {
+		if ((ch343->info->flags & CH343_CI_STATUS_PORT0) &&
+		    data[0] != 0x00)
+			return;
+		type = data[1];
+	}
+
+	old_in = new_in = ch343->ctrlin;
+	if (type & CH343_CTT_M) {
+		status = ~data[len - 1] & CH343_CTI_ST;
+		if (ch343->info->flags & CH343_CI_STATUS_CTS)
+			status &= CH343_CTI_C;
+
+		spin_lock_irqsave(&ch343->read_lock, flags);
+		/*
+		 * Lines may have moved while the urbs were stopped, so the
+		 * first report after they start only sets the baseline.
+		 */
+		baseline = !ch343->ctrlin_known;
+		old_in = baseline ? status : ch343->ctrlin;
+		new_in = status;
+		difference = status ^ old_in;
+		ch343->ctrlin = status;
+		ch343->ctrlin_known = true;
+#if IS_ENABLED(CONFIG_PPS)
+		if (stamped && (difference & ch343->pps_line))
+			ch343_pps_event(ch343, &ts, status);
+#endif
+		spin_unlock_irqrestore(&ch343->read_lock, flags);
+		if (baseline)
+			wake_up_interruptible_all(&ch343->status_wait);
+
+		if (!baseline && !ch343->clocal &&
+		    (old_in & status & CH343_CTI_DC)) {
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0))
+			struct tty_struct *tty =
+				tty_port_tty_get(&ch343->port);
+			tty_hangup(tty);
+#else
+			tty_port_tty_hangup(&ch343->port, false);
+#endif
+		}
+
+		if (difference) {
+			write_seqcount_begin(&ch343->icount.seq);
+			if (difference & CH343_CTI_C)
+				ch343->icount.c.cts++;
+			if (difference & CH343_CTI_DS)
+				ch343->icount.c.dsr++;
+			if (difference & CH343_CTI_R)
+				ch343->icount.c.rng++;
+			if (difference & CH343_CTI_DC)
+				ch343->icount.c.dcd++;
+			write_seqcount_end(&ch343->icount.seq);
+			/* only waiters on one of these lines are woken */
+			lines = ch343_lines_in(difference);
+			__wake_up(&ch343->wioctl, TASK_INTERRUPTIBLE, 0,
+				  (void *)lines);
+		}
+		handled = 1;
+	}
+	if (type & (CH343_CTT_B | CH343_CTT_O | CH343_CTT_P)) {
+		write_seqcount_begin(&ch343->icount.seq);
+		if (type & CH343_CTT_B) {
+			ch343->icount.c.brk++;
+			errors |= CH343_MEV_BREAK;
+		}
+		if (type & CH343_CTT_O) {
+			ch343->icount.c.overrun++;
+			errors |= CH343_MEV_OVERRUN;
+		}
+		if ((type & CH343_CTT_F) == CH343_CTT_F) {
+			ch343->icount.c.frame++;
+			errors |= CH343_MEV_FRAME;
+		} else if (type & CH343_CTT_P) {
+			ch343->icount.c.parity++;
+			errors |= CH343_MEV_PARITY;
+		}
+		write_seqcount_end(&ch343->icount.seq);
+		handled = 1;
+	}
+	if (old_in != new_in || errors)
+		ch343_mev_push(ch343, now, old_in, new_in, errors);
+	if (!handled)
+		dev_err(&ch343->control->dev,
+			"%s - unknown status received:"
+			"len:%d, data0:0x%x, data1:0x%x\n",
+			__func__, (int)len, data[0], data[1]);
+}
+
+static void ch343_ctrl_irq(struct urb *urb)
+{
+	struct ch343 *ch343 = urb->context;
+	unsigned char *data = urb->transfer_buffer;
+	unsigned int len = urb->actual_length;
+	int status = urb->status;
+	int retval;
+
+	if (ch343_traced(any))
+		ch343_trace_urb(ch343, CH343_TR_STATUS, urb, ktime_set(0, 0));
+
+	switch (status) {
+	case 0:
+		/* success */
+		break;
+	case -ECONNRESET:
+	case -ENOENT:
+	case -ESHUTDOWN:
+		/* this urb is terminated, clean up */
+		dev_dbg(&ch343->control->dev,
+			"%s - urb shutting down with status: %d\n",
+			__func__, status);
+		return;
+	default:
+		dev_dbg(&ch343->control->dev,
+			"%s - nonzero urb status received: %d\n", __func__,
+			status);
+		goto exit;
+	}
+
+	usb_mark_last_busy(ch343->dev);
+	ch343->status_completions++;
+	ch343_update_status(ch343, data, len);
+exit:
+	retval = usb_submit_urb(urb, GFP_ATOMIC);
+	if (retval && retval != -EPERM)
+		dev_err(&ch343->control->dev,
+			"%s - usb_submit_urb failed: %d\n", __func__,
+			retval);
+}
+
+/*
+ * Status urbs. With two in flight the endpoint is polled again while a
+ * completed urb is handled and resubmitted, so an event arriving in
+ * that window does not wait for the next poll interval.
+ */
+static int ch343_status_submit(struct ch343 *ch343, gfp_t mem_flags)
+{
+	int i, rv;
+
+	for (i = 0; i < ch343->status_urbs; i++) {
+		rv = usb_submit_urb(ch343->ctrlurb[i], mem_flags);
+		if (rv)
+			return rv;
+	}
+	/* the host controller may have replaced the interval we asked for */
+	WRITE_ONCE(ch343->status_period, ch343->ctrlurb[0]->interval);
+
+	return 0;
+}
+
+static void ch343_status_kill(struct ch343 *ch343)
+{
+	int i;
+
+	for (i = 0; i < CH343_NCTRL; i++)
+		usb_kill_urb(ch343->ctrlurb[i]);
+}
+
+/*
+ * Applies status_interval, the status urbs must not be in flight. This
+ * only sets urb->interval, which not every host controller honours:
+ * xHCI polls at the interval of its endpoint context and writes that
+ * back into the urb on submit, EHCI keeps the period of the first
+ * submission for as long as the endpoint stays scheduled. What the
+ * host actually uses is read back into status_period on submit.
+ */
+static void ch343_status_set_interval(struct ch343 *ch343)
+{
+	unsigned int us = ch343->status_interval;
+	int interval, i;
+
+	if (!us)
+		interval = ch343->ctrl_interval;
+	else if (ch343->dev->speed >= USB_SPEED_HIGH)
+		/* microframes, host controllers use powers of two */
+		interval = min_t(unsigned long,
+				 rounddown_pow_of_two(max(us / 125, 1U)),
+				 1 << 15);
+	else
+		interval = clamp_t(unsigned int, us / 1000, 1, 255);
+
+	for (i = 0; i < CH343_NCTRL; i++)
+		ch343->ctrlurb[i]->interval = interval;
+}
+
+/*
+ * Applies new status settings, restarting the urbs if they are running.
+ */
+static int ch343_status_update(struct ch343 *ch343)
+{
+	int rv = 0;
+
+	mutex_lock(&ch343->mutex);
+	if (!ch343->status_running || ch343->disconnected) {
+		ch343_status_set_interval(ch343);
+		goto out;
+	}
+
+	rv = usb_autopm_get_interface(ch343->control);
+	if (rv)
+		goto out;
+	ch343_status_kill(ch343);
+	ch343_status_set_interval(ch343);
+	rv = ch343_status_submit(ch343, GFP_KERNEL);
+	usb_autopm_put_interface(ch343->control);
+out:
+	mutex_unlock(&ch343->mutex);
+
+	return rv;
+}
+
+/*
+ * Whether an open port polls the status endpoint. On demand it does so
+ * only while line changes have a consumer: DCD hangup, hardware flow
+ * control, TIOCMIWAIT, the modem event fd, a PPS source or a recent
+ * TIOCMGET/TIOCGICOUNT.
+ */
+static bool ch343_status_wanted(struct ch343 *ch343)
+{
+	switch (ch343->status_poll) {
+	case CH343_POLL_NEVER:
+		return false;
+	case CH343_POLL_ON_DEMAND:
+		return !ch343->clocal || (ch343->ctrlout & CH343_CTO_A) ||
+		       ch343->status_waiters || READ_ONCE(ch343->mev.open) ||
+		       ch343->pps_line || ch343->status_peek;
+	default:
+		return true;
+	}
+}
+
+/* Accounts the time since the last change of status_running. */
+static void ch343_status_account(struct ch343 *ch343)
+{
+	ktime_t now = ktime_get();
+
+	if (!ch343->status_running)
+		ch343->status_idle_ns +=
+			ktime_to_ns(ktime_sub(now, ch343->status_since));
+	ch343->status_since = now;
+}
+
+/*
+ * Starts or stops the status urbs of an open port as the policy and its
+ * consumers ask. Called with ch343->mutex held.
+ */
+static int ch343_status_refresh(struct ch343 *ch343)
+{
+	bool want;
+	int rv;
+
+	if (!ch343->status_open || ch343->disconnected)
+		return 0;
+	want = ch343_status_wanted(ch343);
+	if (want == ch343->status_running)
+		return 0;
+
+	rv = usb_autopm_get_interface(ch343->control);
+	if (rv)
+		return rv;
+	ch343_status_account(ch343);
+	if (want) {
+		spin_lock_irq(&ch343->read_lock);
+		ch343->ctrlin_known = false;
+		spin_unlock_irq(&ch343->read_lock);
+		rv = ch343_status_submit(ch343, GFP_KERNEL);
+		if (rv)
+			ch343_status_kill(ch343);
+	} else {
+		ch343_status_kill(ch343);
+	}
+	ch343->status_running = want && !rv;
+	usb_autopm_put_interface(ch343->control);
+
+	return rv;
+}
+
+/* Stops the status urbs on close, called with ch343->mutex held. */
+static void ch343_status_close(struct ch343 *ch343)
+{
+	ch343_status_account(ch343);
+	ch343->status_open = false;
+	ch343->status_running = false;
+	ch343->status_peek = false;
+	ch343_status_kill(ch343);
+}
+
+/*
+ * Without a consumer on-demand polling is off and ctrlin and the line
+ * counters stay as they were when it stopped. TIOCMGET and TIOCGICOUNT
+ * therefore open a window of CH343_STATUS_WINDOW ms of polling, renewed
+ * by each call. A call that starts the urbs waits up to
+ * CH343_STATUS_SETTLE ms for the baseline report. This assumes the chip
+ * answers the first interrupt poll with its line state even when no
+ * line changed; if it does not, the call returns the lines last seen.
+ */
+static void ch343_status_peek(struct ch343 *ch343)
+{
+	bool started;
+
+	if (READ_ONCE(ch343->status_poll) != CH343_POLL_ON_DEMAND)
+		return;
+
+	mutex_lock(&ch343->mutex);
+	if (!ch343->status_open) {
+		mutex_unlock(&ch343->mutex);
+		return;
+	}
+	started = !ch343->status_running;
+	ch343->status_peek = true;
+	ch343->status_peek_last = jiffies;
+	if (ch343_status_refresh(ch343))
+		started = false;
+	started = started && ch343->status_running;
+	/* under the mutex, so that shutdown's cancel cannot miss it */
+	schedule_delayed_work(&ch343->status_work,
+			      msecs_to_jiffies(CH343_STATUS_WINDOW));
+	mutex_unlock(&ch343->mutex);
+
+	if (started)
+		wait_event_interruptible_timeout(
+			ch343->status_wait,
+			READ_ONCE(ch343->ctrlin_known) || ch343->disconnected,
+			msecs_to_jiffies(CH343_STATUS_SETTLE));
+}
+
+static void ch343_status_peek_end(struct work_struct *work)
+{
+	struct ch343 *ch343 = container_of(to_delayed_work(work),
+					   struct ch343, status_work);
+	unsigned long window = msecs_to_jiffies(CH343_STATUS_WINDOW);
+
+	mutex_lock(&ch343->mutex);
+	if (!ch343->status_peek)
+		goto out;
+	if (time_before(jiffies, ch343->status_peek_last + window)) {
+		schedule_delayed_work(&ch343->status_work,
+				      ch343->status_peek_last + window -
+					      jiffies);
+		goto out;
+	}
+	ch343->status_peek = false;
+	ch343_status_refresh(ch343);
+out:
+	mutex_unlock(&ch343->mutex);
+}
+
+static int ch343_submit_read_urb(struct ch343 *ch343, int index,
+				 gfp_t mem_flags)
+{
+	int res;
+
+	if (!test_and_clear_bit(index, &ch343->read_urbs_free))
+		return 0;
+
+	res = usb_submit_urb(ch343->read_urbs[index], mem_flags);
+	if (res) {
+		if (res != -EPERM) {
+			dev_err(&ch343->data->dev,
+				"%s - usb_submit_urb failed: %d\n",
+				__func__, res);
+		}
+		set_bit(index, &ch343->read_urbs_free);
+		return res;
+	}
+	return 0;
+}
+
+static int ch343_submit_read_urbs(struct ch343 *ch343, gfp_t mem_flags)
+{
+	int res;
+	int i;
+
+	for (i = 0; i < ch343->rx_buflimit; ++i) {
+		res = ch343_submit_read_urb(ch343, i, mem_flags);
+		if (res)
+			return res;
+	}
+	return 0;
+}
+
+static void ch343_process_read_urb(struct ch343 *ch343, struct urb *urb)
+{
+	if (!urb->actual_length)
+		return;
+
+	u64_stats_update_begin(&ch343->icount.rx_sync);
+	ch343->icount.c.rx += urb->actual_length;
+	u64_stats_update_end(&ch343->icount.rx_sync);
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0))
+	tty_insert_flip_string(&ch343->port, urb->transfer_buffer,
+			       urb->actual_length);
+	tty_flip_buffer_push(&ch343->port);
+#else
+	struct tty_struct *tty = tty_port_tty_get(&ch343->port);
+	tty_insert_flip_string(tty, urb->transfer_buffer,
+			       urb->actual_length);
+	tty_flip_buffer_push(tty);
+#endif
+}
+
+static void ch343_read_bulk_callback(struct urb *urb)
+{
+	struct ch343_rb *rb = urb->context;
+	struct ch343 *ch343 = rb->instance;
+	int status = urb->status;
+
+	if (!ch343->dev) {
+		set_bit(rb->index, &ch343->read_urbs_free);
+		dev_dbg(&ch343->data->dev, "%s - disconnected\n",
+			__func__);
+		return;
+	}
+
+	if (ch343_traced(any))
+		ch343_trace_urb(ch343, CH343_TR_RX, urb, ktime_set(0, 0));
+
+	if (status) {
+		set_bit(rb->index, &ch343->read_urbs_free);
+		dev_dbg(&ch343->data->dev,
+			"%s - non-zero urb status: %d\n", __func__,
+			status);
+		return;
+	}
+
+	usb_mark_last_busy(ch343->dev);
+	ch343_process_read_urb(ch343, urb);
+	set_bit(rb->index, &ch343->read_urbs_free);
+	ch343_submit_read_urb(ch343, rb->index, GFP_ATOMIC);
+}
+
+static void ch343_write_bulk(struct urb *urb)
+{
+	struct ch343_wb *wb = urb->context;
+	struct ch343 *ch343 = wb->instance;
+	unsigned long flags;
+	int status = urb->status;
+	bool direct;
+	struct ch343_txts ts;
+	u32 seq_gen;
+
+	if (ch343_traced(any))
+		ch343_trace_urb(ch343, CH343_TR_TX, urb,
+				wb->stamped ? wb->submit : ktime_set(0, 0));
+
+	if (wb->ticket) {
+		ts.complete_ns = ktime_to_ns(ktime_get());
+		ts.submit_ns = ktime_to_ns(wb->submit);
+		ts.ticket = wb->ticket;
+		ts.bytes = urb->actual_length;
+		ts.status = status;
+		/* write completions are serialized, txts_lost needs no lock */
+		ts.lost = ch343->txts_lost;
+		if (ch343_evq_push(&ch343->txts, &ts))
+			ch343->txts_lost = 0;
+		else
+			ch343->txts_lost++;
+	}
+
+	if (status || (urb->actual_length != urb->transfer_buffer_length))
+		dev_vdbg(&ch343->data->dev, "%s - len %d/%d, status %d\n",
+			 __func__, urb->actual_length,
+			 urb->transfer_buffer_length, status);
+
+	u64_stats_update_begin(&ch343->icount.tx_sync);
+	ch343->icount.c.tx += urb->actual_length;
+	u64_stats_update_end(&ch343->icount.tx_sync);
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	seq_gen = wb->seq_gen;
+	wb->seq_gen = 0;
+	ch343_write_done(ch343, wb);
+	if (seq_gen)
+		ch343_seq_advance(ch343, seq_gen, status < 0 ? status : 0,
+				  false);
+	wake_up_interruptible(&ch343->sendioctl);
+	direct = ch343->tx_wakeup_direct;
+	if (direct)
+		ch343->tx_wakeups_direct++;
+	else
+		ch343->tx_wakeups_deferred++;
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
+
+	/*
+	 * tty_port_tty_wakeup() is safe in interrupt context, so writers
+	 * can be woken here without a work queue round trip.
+	 */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0))
+	if (direct) {
+		tty_port_tty_wakeup(&ch343->port);
+		return;
+	}
+#endif
+	schedule_work(&ch343->work);
+}
+
+static void ch343_softint(struct work_struct *work)
+{
+	struct ch343 *ch343 = container_of(work, struct ch343, work);
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0))
+	struct tty_struct *tty;
+
+	tty = tty_port_tty_get(&ch343->port);
+	if (!tty)
+		return;
+	tty_wakeup(tty);
+	tty_kref_put(tty);
+#else
+	tty_port_tty_wakeup(&ch343->port);
+#endif
+}
+
+static int ch343_tty_install(struct tty_driver *driver,
+			     struct tty_struct *tty)
+{
+	struct ch343 *ch343;
+	int retval;
+
+	ch343 = ch343_get_by_index(tty->index);
+	if (!ch343)
+		return -ENODEV;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0))
+	retval = tty_standard_install(driver, tty);
+	if (retval)
+		goto error_init_termios;
+
+	tty->driver_data = ch343;
+#else
+	retval = tty_init_termios(tty);
+	if (retval)
+		goto error_init_termios;
+
+	tty->driver_data = ch343;
+
+	/* Final install (we use the default method) */
+	tty_driver_kref_get(driver);
+	tty->count++;
+	driver->ttys[tty->index] = tty;
+#endif
+
+	return 0;
+
+error_init_termios:
+	tty_port_put(&ch343->port);
+	return retval;
+}
+
+static int ch343_tty_open(struct tty_struct *tty, struct file *filp)
+{
+	struct ch343 *ch343 = tty->driver_data;
+
+	if (tty)
+		ch343_tty_set_termios(tty, NULL);
+
+	return tty_port_open(&ch343->port, tty, filp);
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0))
+static void ch343_port_dtr_rts(struct tty_port *port, bool raise)
+#else
+static void ch343_port_dtr_rts(struct tty_port *port, int raise)
+#endif
+{
+	struct ch343 *ch343 = container_of(port, struct ch343, port);
+	unsigned int ctrl;
+	int res;
+
+#ifdef IGNORE_RTSDTR
+	return;
+#endif
+
+	ctrl = raise ? CH343_CTO_D | CH343_CTO_R : 0;
+	ctrl = ch343_ctrlout_update(ch343, CH343_CTO_D | CH343_CTO_R, ctrl,
+				    NULL);
+
+	res = ch343_set_control(ch343, ctrl);
+	if (res)
+		dev_err(&ch343->control->dev, "failed to set dtr/rts\n");
+}
+
+static int ch343_port_activate(struct tty_port *port,
+			       struct tty_struct *tty)
+{
+	struct ch343 *ch343 = container_of(port, struct ch343, port);
+	int retval = -ENODEV;
+	int i;
+
+	mutex_lock(&ch343->mutex);
+	if (ch343->disconnected)
+		goto disconnected;
+
+	retval = usb_autopm_get_interface(ch343->control);
+	if (retval)
+		goto error_get_interface;
+
+	set_bit(TTY_NO_WRITE_SPLIT, &tty->flags);
+	ch343->control->needs_remote_wakeup = 1;
+
+	ch343->status_open = true;
+	ch343->status_since = ktime_get();
+	retval = ch343_status_refresh(ch343);
+	if (retval) {
+		dev_err(&ch343->control->dev,
+			"%s - usb_submit_urb(ctrl cmd) failed\n",
+			__func__);
+		goto error_submit_urb;
+	}
+	retval = ch343_submit_read_urbs(ch343, GFP_KERNEL);
+	if (retval)
+		goto error_submit_read_urbs;
+
+	if (ch343->info->flags & CH343_CI_PORT_EN) {
+		/* queued ahead of any later request, no need to wait */
+		retval = ch343_set_state(ch343, CH343_SH_PORT, CMD_C8,
+					 0x01 | (ch343->iface << 8), 0x00, 0);
+		ch343_clock_invalidate(ch343, false);
+		if (retval) {
+			goto error_submit_read_urbs;
+		}
+	}
+
+	if (ch343->info->flags & CH343_CI_AUTOBAUD) {
+		/* no count matches, so the first poll always reads */
+		ch343->autobaud_rx = ~0ULL;
+		schedule_delayed_work(&ch343->autobaud_work, 0);
+	}
+
+	usb_autopm_put_interface(ch343->control);
+	mutex_unlock(&ch343->mutex);
+
+	return 0;
+
+error_submit_read_urbs:
+	for (i = 0; i < ch343->rx_buflimit; i++)
+		usb_kill_urb(ch343->read_urbs[i]);
+error_submit_urb:
+	ch343_status_close(ch343);
+	usb_autopm_put_interface(ch343->control);
+error_get_interface:
+disconnected:
+	mutex_unlock(&ch343->mutex);
+	return usb_translate_errors(retval);
+}
+
+static void ch343_port_destruct(struct tty_port *port)
+{
+	struct ch343 *ch343 = container_of(port, struct ch343, port);
+
+	ch343_release_minor(ch343);
+	/* late ioctl and sysfs callers may still hold a request */
+	ch343_cr_free(ch343);
+	if (ch343->chip)
+		ch343_chip_put(ch343->chip);
+	usb_put_intf(ch343->control);
+	memset(ch343, 0x00, sizeof(struct ch343));
+	kfree(ch343);
+}
+
+static void ch343_port_shutdown(struct tty_port *port)
+{
+	struct ch343 *ch343 = container_of(port, struct ch343, port);
+	struct urb *urb;
+	struct ch343_wb *wb;
+	int i;
+	int r;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0))
+
+	usb_autopm_get_interface_no_resume(ch343->control);
+	ch343->control->needs_remote_wakeup = 0;
+	usb_autopm_put_interface(ch343->control);
+
+	for (;;) {
+		urb = usb_get_from_anchor(&ch343->delayed);
+		if (!urb)
+			break;
+		wb = urb->context;
+		wb->use = 0;
+	}
+
+	mutex_lock(&ch343->mutex);
+	ch343_status_close(ch343);
+	mutex_unlock(&ch343->mutex);
+	for (i = 0; i < CH343_NW; i++)
+		usb_kill_urb(ch343->wb[i].urb);
+	for (i = 0; i < ch343->rx_buflimit; i++)
+		usb_kill_urb(ch343->read_urbs[i]);
+
+#else
+	mutex_lock(&ch343->mutex);
+	if (!ch343->disconnected) {
+		usb_autopm_get_interface(ch343->control);
+		ch343_set_control(ch343,
+				  ch343_ctrlout_update(ch343, ~0U, 0, NULL));
+
+		ch343_status_close(ch343);
+		for (i = 0; i < CH343_NW; i++)
+			usb_kill_urb(ch343->wb[i].urb);
+		for (i = 0; i < ch343->rx_buflimit; i++)
+			usb_kill_urb(ch343->read_urbs[i]);
+		ch343->control->needs_remote_wakeup = 0;
+
+		usb_autopm_put_interface(ch343->control);
+	}
+	mutex_unlock(&ch343->mutex);
+#endif
+
+	if (ch343->info->flags & CH343_CI_PORT_EN) {
+		r = ch343_set_state(ch343, CH343_SH_PORT, CMD_C8,
+				    0x02 | (ch343->iface << 8), 0x00, 0);
+		if (r)
+			dev_err(&ch343->control->dev, "%s - failed: %d\n",
+				__func__, r);
+		ch343_clock_invalidate(ch343, true);
+	}
+
+	cancel_delayed_work_sync(&ch343->autobaud_work);
+	cancel_delayed_work_sync(&ch343->status_work);
+	hrtimer_cancel(&ch343->tx_timer);
+	/* the pacing timer may have queued a wakeup */
+	cancel_work_sync(&ch343->work);
+	ch343_tx_pm_release(ch343);
+}
+
+static void ch343_tty_cleanup(struct tty_struct *tty)
+{
+	struct ch343 *ch343 = tty->driver_data;
+	tty_port_put(&ch343->port);
+}
+
+static void ch343_tty_hangup(struct tty_struct *tty)
+{
+	struct ch343 *ch343 = tty->driver_data;
+	tty_port_hangup(&ch343->port);
+}
+
+static void ch343_tty_close(struct tty_struct *tty, struct file *filp)
+{
+	struct ch343 *ch343 = tty->driver_data;
+	tty_port_close(&ch343->port, tty, filp);
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0))
+static ssize_t ch343_tty_write(struct tty_struct *tty, const u8 *buf,
+			       size_t count)
+#else
+static int ch343_tty_write(struct tty_struct *tty,
+			   const unsigned char *buf, int count)
+#endif
+{
+	struct ch343 *ch343 = tty->driver_data;
+	int stat;
+	unsigned long flags;
+	int wbn;
+	struct ch343_wb *wb;
+	int timeout;
+
+	if (!count)
+		return 0;
+
+retry:
+	spin_lock_irqsave(&ch343->write_lock, flags);
+	/*
+	 * data after a pending line coding barrier must use the new one,
+	 * and must not land inside a break framed transmit
+	 */
+	if (ch343->cr_barriers || ch343->seq.hold_tx) {
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		return 0;
+	}
+	wbn = ch343_wb_alloc(ch343);
+	if (wbn < 0) {
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		timeout = wait_event_interruptible_timeout(
+			ch343->sendioctl, ch343_wb_is_avail(ch343),
+			msecs_to_jiffies(DEFAULT_TIMEOUT));
+		if (timeout <= 0) {
+			return -ETIMEDOUT;
+		} else
+			goto retry;
+	}
+	wb = &ch343->wb[wbn];
+
+	if (!ch343->dev) {
+		wb->use = 0;
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		return -ENODEV;
+	}
+
+	count = (count > ch343->writesize) ? ch343->writesize : count;
+
+	count = ch343_tx_pace(ch343, count);
+	if (!count) {
+		wb->use = 0;
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		return 0;
+	}
+
+	memcpy(wb->buf, buf, count);
+	wb->len = count;
+	/* set_termios may replace the coding before this urb completes */
+	wb->drain_ns = ch343_tx_drain_ns(ch343, count);
+
+	if (!ch343->tx_pm_held) {
+		stat = usb_autopm_get_interface_async(ch343->control);
+		if (stat) {
+			wb->use = 0;
+			spin_unlock_irqrestore(&ch343->write_lock, flags);
+			return stat;
+		}
+		ch343->tx_pm_held = true;
+	}
+
+	if (ch343->susp_count) {
+		usb_anchor_urb(wb->urb, &ch343->delayed);
+		spin_unlock_irqrestore(&ch343->write_lock, flags);
+		return count;
+	}
+
+	stat = ch343_start_wb(ch343, wb);
+	spin_unlock_irqrestore(&ch343->write_lock, flags);
+
+	if (stat < 0)
+		return stat;
+	return count;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0))
+static unsigned int ch343_tty_write_room(struct tty_struct *tty)
+#else
+static int ch343_tty_write_room(struct tty_struct *tty)
+#endif
+{
+	struct ch343 *ch343 = tty->driver_data;
+
+	if (ch343->cr_barriers || ch343->seq.hold_tx)
+		return 0;
+
+	return ch343_wb_is_avail(ch343) ? ch343->writesize : 0;
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 14, 0))
+static unsigned int ch343_tty_chars_in_buffer(struct tty_struct *tty)
+#else
+static int ch343_tty_chars_in_buffer(struct tty_struct *tty)
+#endif
+{
+	struct ch343 *ch343 = tty->driver_data;
+
+	if (ch343->disconnected)
+		return 0;
+
+	return (CH343_NW - ch343_wb_is_avail(ch343)) * ch343->writesize;
+}
+
+static int ch343_tty_break_ctl(struct tty_struct *tty, int state)
+{
+	struct ch343 *ch343 = tty->driver_data;
+	int retval;
+	u16 value, index;
+
+	ch343_break_encode(ch343, state, &value, &index);
+
+	/*
+	 * Wait for the break to be on the wire before the tty layer starts
+	 * timing it, ending it needs no wait.
+	 */
+	retval = ch343_set_state(ch343, CH343_SH_BREAK, CMD_C4, value, index,
+				 state != 0 ? CH343_CR_WAIT : 0);
+
+	if (retval < 0)
+		dev_err(&ch343->control->dev,
+			"%s - USB control write error (%d)\n", __func__,
+			retval);
+
+	return retval;
+}
+
+static int ch343_tty_tiocmget(struct tty_struct *tty)
+{
+	struct ch343 *ch343 = tty->driver_data;
+	unsigned long flags;
+	unsigned int result;
+
+	ch343_status_peek(ch343);
+
+	spin_lock_irqsave(&ch343->read_lock, flags);
+	result = (ch343->ctrlout & CH343_CTO_D ? TIOCM_DTR : 0) |
+		 (ch343->ctrlout & CH343_CTO_R ? TIOCM_RTS : 0) |
+		 ch343_lines_in(ch343->ctrlin);
+	spin_unlock_irqrestore(&ch343->read_lock, flags);
+
+	return result;
+}
+
+static int ch343_tty_tiocmset(struct tty_struct *tty, unsigned int set,
+			      unsigned int clear)
+{
+	struct ch343 *ch343 = tty->driver_data;
+	unsigned int newctrl;
+	bool changed;
+
+	set = (set & TIOCM_DTR ? CH343_CTO_D : 0) |
+	      (set & TIOCM_RTS ? CH343_CTO_R : 0);
+	clear = (clear & TIOCM_DTR ? CH343_CTO_D : 0) |
+		(clear & TIOCM_RTS ? CH343_CTO_R : 0);
+
+	newctrl = ch343_ctrlout_update(ch343, clear, set, &changed);
+	if (!changed)
+		return 0;
+
+	return ch343_set_control(ch343, newctrl);
+}
+
+/* Takes a consistent copy of the counters. */
+static void ch343_icount_read(struct ch343 *ch343, struct ch343_icounts *c)
+{
+	struct ch343_icount *ic = &ch343->icount;
+	unsigned int start;
+
+	do {
+		start = read_seqcount_begin(&ic->seq);
+		*c = ic->c;
+	} while (read_seqcount_retry(&ic->seq, start));
+
+	do {
+		start = u64_stats_fetch_begin(&ic->rx_sync);
+		c->rx = ic->c.rx;
+	} while (u64_stats_fetch_retry(&ic->rx_sync, start));
+
+	do {
+		start = u64_stats_fetch_begin(&ic->tx_sync);
+		c->tx = ic->c.tx;
+	} while (u64_stats_fetch_retry(&ic->tx_sync, start));
+}
+
+static void ch343_icount_init(struct ch343 *ch343)
+{
+	seqcount_init(&ch343->icount.seq);
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0))
+	u64_stats_init(&ch343->icount.rx_sync);
+	u64_stats_init(&ch343->icount.tx_sync);
+#endif
+}
+
+/*
+ * Whether a line selected by the TIOCM_* mask @arg changed since @old.
+ * The line counters serve as per-line sequence numbers, a waiter only
+ * compares those it waits on.
+ */
+static bool ch343_icount_changed(struct ch343 *ch343,
+				 const struct ch343_icounts *old,
+				 unsigned long arg)
+{
+	struct ch343_icount *ic = &ch343->icount;
+	struct ch343_icounts cnow;
+	unsigned int start;
+
+	do {
+		start = read_seqcount_begin(&ic->seq);
+		cnow.cts = ic->c.cts;
+		cnow.dsr = ic->c.dsr;
+		cnow.rng = ic->c.rng;
+		cnow.dcd = ic->c.dcd;
+	} while (read_seqcount_retry(&ic->seq, start));
+
+	return ((arg & TIOCM_CTS) && old->cts != cnow.cts) ||
+	       ((arg & TIOCM_DSR) && old->dsr != cnow.dsr) ||
+	       ((arg & TIOCM_RI) && old->rng != cnow.rng) ||
+	       ((arg & TIOCM_CD) && old->dcd != cnow.dcd);
+}
+
+static int ch343_get_icount(struct tty_struct *tty,
+			    struct serial_icounter_struct *icount)
+{
+	struct ch343 *ch343 = tty->driver_data;
+	struct ch343_icounts cnow;
+
+	ch343_status_peek(ch343);
+	ch343_icount_read(ch343, &cnow);
+
+	icount->cts = cnow.cts;
+	icount->dsr = cnow.dsr;
+	icount->rng = cnow.rng;
+	icount->dcd = cnow.dcd;
+	icount->tx = cnow.tx;
+	icount->rx = cnow.rx;
+	icount->frame = cnow.frame;
+	icount->parity = cnow.parity;
+	icount->overrun = cnow.overrun;
+	icount->brk = cnow.brk;
+	icount->buf_overrun = cnow.buf_overrun;
+
+	return 0;
+}
+
+static int ch343_get_serial_info(struct ch343 *ch343,
+				 struct serial_struct __user *info)
+{
+	struct serial_struct tmp;
+
+	if (!info)
+		return -EINVAL;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.flags = ASYNC_LOW_LATENCY;
+	tmp.xmit_fifo_size = ch343->writesize;
+	tmp.baud_base = le32_to_cpu(ch343->line.dwDTERate);
+	tmp.close_delay = ch343->port.close_delay / 10;
+	tmp.closing_wait = ch343->port.closing_wait ==
+					   ASYNC_CLOSING_WAIT_NONE ?
+				   ASYNC_CLOSING_WAIT_NONE :
+				   ch343->port.closing_wait / 10;
+
+	if (copy_to_user(info, &tmp, sizeof(tmp)))
+		return -EFAULT;
+	else
+		return 0;
+}
+
+static int ch343_set_serial_info(struct ch343 *ch343,
+				 struct serial_struct __user *newinfo)
+{
+	struct serial_struct new_serial;
+	unsigned int closing_wait, close_delay;
+	int retval = 0;
+
+	if (copy_from_user(&new_serial, newinfo, sizeof(new_serial)))
+		return -EFAULT;
+
+	close_delay = new_serial.close_delay * 10;
+	closing_wait = new_serial.closing_wait == ASYNC_CLOSING_WAIT_NONE ?
+			       ASYNC_CLOSING_WAIT_NONE :
+			       new_serial.closing_wait * 10;
+
+	mutex_lock(&ch343->port.mutex);
+
+	if (!capable(CAP_SYS_ADMIN)) {
+		if ((close_delay != ch343->port.close_delay) ||
+		    (closing_wait != ch343->port.closing_wait))
+			retval = -EPERM;
+		else
+			retval = -EOPNOTSUPP;
+	} else {
+		ch343->port.close_delay = close_delay;
+		ch343->port.closing_wait = closing_wait;
+	}
+
+	mutex_unlock(&ch343->port.mutex);
+	return retval;
+}
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0))
+typedef wait_queue_t wait_queue_entry_t;
+#endif
+
+/*
+ * TIOCMIWAIT waiter. The status handler passes the TIOCM_* lines that
+ * changed as the wake key, so a waiter is only woken for its own lines
+ * and many monitors on one port do not wake each other. A NULL key, as
+ * from wake_up_all() on disconnect, wakes everyone.
+ */
+struct ch343_line_wait {
+	unsigned long mask;
+	wait_queue_entry_t wait;
+};
+
+static int ch343_line_wake(wait_queue_entry_t *wait, unsigned int mode,
+			   int sync, void *key)
+{
+	struct ch343_line_wait *lw =
+		container_of(wait, struct ch343_line_wait, wait);
+	unsigned long lines = (unsigned long)key;
+
+	if (lines && !(lines & lw->mask))
+		return 0;
+
+	return default_wake_function(wait, mode, sync, key);
+}
+
+static int ch343_wait_serial_change(struct ch343 *ch343, unsigned long arg)
+{
+	struct ch343_line_wait lw;
+	struct ch343_icounts old;
+	int rv = 0;
+
+	lw.mask = arg & (TIOCM_CTS | TIOCM_DSR | TIOCM_RI | TIOCM_CD);
+	init_waitqueue_func_entry(&lw.wait, ch343_line_wake);
+	lw.wait.private = current;
+
+	/* a waiter keeps on-demand status polling running */
+	mutex_lock(&ch343->mutex);
+	if (ch343->status_poll == CH343_POLL_NEVER) {
+		mutex_unlock(&ch343->mutex);
+		return -EOPNOTSUPP;
+	}
+	ch343->status_waiters++;
+	rv = ch343_status_refresh(ch343);
+	mutex_unlock(&ch343->mutex);
+	if (rv)
+		goto out;
+
+	/* changes are counted from the call, not from an earlier event */
+	ch343_icount_read(ch343, &old);
+
+	add_wait_queue(&ch343->wioctl, &lw.wait);
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (ch343_icount_changed(ch343, &old, arg))
+			break;
+		if (ch343->disconnected) {
+			if (!(arg & TIOCM_CD))
+				rv = -ENODEV;
+			break;
+		}
+		if (READ_ONCE(ch343->status_poll) == CH343_POLL_NEVER) {
+			rv = -EOPNOTSUPP;
+			break;
+		}
+		if (signal_pending(current)) {
+			rv = -ERESTARTSYS;
+			break;
+		}
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+	remove_wait_queue(&ch343->wioctl, &lw.wait);
+out:
+	mutex_lock(&ch343->mutex);
+	ch343->status_waiters--;
+	ch343_status_refresh(ch343);
+	mutex_unlock(&ch343->mutex);
+
+	return rv;
+}
+
+static int
+ch343_get_serial_usage(struct ch343 *ch343,
+		       struct serial_icounter_struct __user *count)
+{
+	struct serial_icounter_struct icount;
+	struct ch343_icounts cnow;
+	int rv = 0;
+
+	ch343_status_peek(ch343);
+	ch343_icount_read(ch343, &cnow);
+
+	memset(&icount, 0, sizeof(icount));
+	icount.cts = cnow.cts;
+	icount.dsr = cnow.dsr;
+	icount.rng = cnow.rng;
+	icount.dcd = cnow.dcd;
+	icount.tx = cnow.tx;
+	icount.rx = cnow.rx;
+	icount.frame = cnow.frame;
+	icount.overrun = cnow.overrun;
+	icount.parity = cnow.parity;
+	icount.brk = cnow.brk;
+	icount.buf_overrun = cnow.buf_overrun;
+
+	if (copy_to_user(count, &icount, sizeof(icount)) > 0)
+		rv = -EFAULT;
+
+	return rv;
+}
+
+static int ch343_regio(struct ch343 *ch343, unsigned int cmd,
+		       void __user *arg)
+{
+	struct ch343_regio *rio;
+	int rv;
+
+	rio = kmalloc(sizeof(*rio), GFP_KERNEL);
+	if (!rio)
+		return -ENOMEM;
+
+	if (copy_from_user(rio, arg, sizeof(*rio))) {
+		rv = -EFAULT;
+		goto out;
+	}
+	if (!rio->count || rio->count > CH343_REGIO_MAX) {
+		rv = -EINVAL;
+		goto out;
+	}
+
+	if (cmd == IOCTL_CMD_REGWRITE) {
+		rv = ch343_regs_write(ch343, rio->start, rio->data,
+				      rio->count);
+		goto out;
+	}
+
+	rv = ch343_regs_read(ch343, rio->start, rio->data, rio->count,
+			     rio->flags & CH343_REGIO_NOCACHE);
+	if (!rv && copy_to_user(arg, rio, sizeof(*rio)))
+		rv = -EFAULT;
+
+out:
+	kfree(rio);
+	return rv;
+}
+
+static int ch343_tty_ioctl(struct tty_struct *tty, unsigned int cmd,
+			   unsigned long arg)
+{
+	struct ch343 *ch343 = tty->driver_data;
+	int rv = 0;
+	unsigned long arg1, arg2, arg3, arg4, arg5, arg6;
+	u32 __user *argval = (u32 __user *)arg;
+	u8 *buffer;
+	struct ch343_txrate txrate;
+
+	buffer = kmalloc(512, GFP_KERNEL);
+	if (!buffer)
+		return -ENOMEM;
+
+	switch (cmd) {
+	case TIOCGSERIAL: /* gets serial port data */
+		rv = ch343_get_serial_info(
+			ch343, (struct serial_struct __user *)arg);
+		break;
+	case TIOCSSERIAL:
+		rv = ch343_set_serial_info(
+			ch343, (struct serial_struct __user *)arg);
+		break;
+	case TIOCMIWAIT:
+		rv = usb_autopm_get_interface(ch343->control);
+		if (rv < 0) {
+			rv = -EIO;
+			break;
+		}
+		rv = ch343_wait_serial_change(ch343, arg);
+		usb_autopm_put_interface(ch343->control);
+		break;
+	case TIOCGICOUNT:
+		rv = ch343_get_serial_usage(
+			ch343,
+			(struct serial_icounter_struct __user *)arg);
+		break;
+	case IOCTL_CMD_GETCHIPTYPE:
+		if (put_user(ch343->chiptype, argval)) {
+			rv = -EFAULT;
+			goto out;
+		}
+		break;
+	case IOCTL_CMD_GETUARTINDEX:
+		if (put_user(ch343->iface, argval)) {
+			rv = -EFAULT;
+			goto out;
+		}
+		break;
+	case IOCTL_CMD_SETTXRATE:
+		if (copy_from_user(&txrate, (void __user *)arg,
+				   sizeof(txrate))) {
+			rv = -EFAULT;
+			goto out;
+		}
+		rv = ch343_set_tx_rate(ch343, txrate.rate, txrate.burst);
+		break;
+	case IOCTL_CMD_TXTSOPEN:
+		rv = ch343_evq_getfd(&ch343->txts, "[ch343_txts]",
+				     CH343_TXTS_LEN);
+		break;
+	case IOCTL_CMD_MEVOPEN:
+		rv = ch343_evq_getfd(&ch343->mev, "[ch343_mev]",
+				     CH343_MEV_LEN);
+		if (rv >= 0) {
+			mutex_lock(&ch343->mutex);
+			ch343_status_refresh(ch343);
+			mutex_unlock(&ch343->mutex);
+		}
+		break;
+	case IOCTL_CMD_CTRLSYNC:
+		rv = ch343_cr_drain(ch343);
+		break;
+	case IOCTL_CMD_REGREAD:
+	case IOCTL_CMD_REGWRITE:
+		rv = ch343_regio(ch343, cmd, (void __user *)arg);
+		break;
+	case IOCTL_CMD_MODEMSEQ:
+		rv = ch343_modem_seq(ch343, (void __user *)arg);
+		break;
+	case IOCTL_CMD_BREAKFRAME:
+		rv = ch343_break_frame(ch343, (void __user *)arg);
+		break;
+	case IOCTL_CMD_GETAUTOBAUD:
+		if (!(ch343->info->flags & CH343_CI_AUTOBAUD)) {
+			rv = -EOPNOTSUPP;
+			goto out;
+		}
+		rv = usb_autopm_get_interface(ch343->control);
+		if (rv)
+			goto out;
+		rv = ch343_autobaud_poll(ch343);
+		usb_autopm_put_interface(ch343->control);
+		if (rv < 0)
+			goto out;
+		if (put_user(rv, argval)) {
+			rv = -EFAULT;
+			goto out;
+		}
+		rv = 0;
+		break;
+	case IOCTL_CMD_GETTXRATE:
+		txrate.rate = ch343->tx_rate;
+		txrate.burst = ch343->tx_burst;
+		if (copy_to_user((void __user *)arg, &txrate,
+				 sizeof(txrate))) {
+			rv = -EFAULT;
+			goto out;
+		}
+		break;
+	case IOCTL_CMD_CTRLIN:
+		get_user(arg1, (u8 __user *)arg);
+		get_user(arg2, ((u8 __user *)arg + 1));
+		get_user(arg3, (u16 __user *)((u8 *)arg + 2));
+		get_user(arg4, (u16 __user *)((u8 *)arg + 4));
+		get_user(arg5, (u16 __user *)((u8 *)arg + 6));
+		arg6 = (unsigned long)((u8 __user *)arg + 8);
+		rv = ch343_control_msg_in(ch343, (u8)arg1, (u8)arg2,
+					  (u16)arg3, (u16)arg4,
+					  (u8 __user *)arg6, (u16)arg5);
+		break;
+	case IOCTL_CMD_CTRLOUT:
+		get_user(arg1, (u8 __user *)arg);
+		get_user(arg2, ((u8 __user *)arg + 1));
+		get_user(arg3, (u16 __user *)((u8 *)arg + 2));
+		get_user(arg4, (u16 __user *)((u8 *)arg + 4));
+		get_user(arg5, (u16 __user *)((u8 *)arg + 6));
+		arg6 = (unsigned long)((u8 __user *)arg + 8);
+		rv = ch343_control_msg_out(ch343, (u8)arg1, (u8)arg2,
+					   (u16)arg3, (u16)arg4,
+					   (u8 __user *)arg6, (u16)arg5);
+		spin_lock_irq(&ch343->write_lock);
+		ch343_shadow_invalidate(ch343);
+		spin_unlock_irq(&ch343->write_lock);
+		if (rv != (u16)arg5) {
+			rv = -EINVAL;
+			goto out;
+		}
+		break;
+	default:
+		rv = -ENOIOCTLCMD;
+		break;
+	}
+out:
+	kfree(buffer);
+	return rv;
+}
+
+/*
+ * Prescaler settings of the classic divisor encoding, as the divider
+ * applied to the 12 MHz reference. Searched in this order; a later
+ * setting is only used if it is strictly closer to the requested rate.
+ */
+static const struct {
+	u8 dvs;
+	u16 div;
+} ch343_prescalers[] = {
+	{ 3, 2 }, { 2, 16 }, { 1, 128 }, { 0, 1024 }, { 7, 1 },
+};
+
+static unsigned int ch343_baud_err(unsigned int rate, unsigned int bval)
+{
+	return rate > bval ? rate - bval : bval - rate;
+}
+
+/*
+ * Find the divisor encoding whose rate is closest to @bval. Returns the
+ * rate the device will actually run at, or 0 if it cannot get within
+ * CH343_BAUD_MAX_ERR of the request.
+ */
+static unsigned int ch343_baud_solve(const struct ch343_chipinfo *info,
+				     unsigned int bval, unsigned char *fct,
+				     unsigned char *dvs)
+{
+	unsigned int best = 0, best_err = UINT_MAX;
+	unsigned int a, div, rate, err;
+	int i, j;
+
+	if (info->baud_fine && bval >= info->baud_fine) {
+		if ((info->flags & CH343_CI_BAUD_MHZ) && bval > 13000000) {
+			/* whole MHz, offset by 13 */
+			a = DIV_ROUND_CLOSEST(bval, 1000000);
+			if (a - 13 > 0xFF)
+				return 0;
+			*fct = a - 13;
+			*dvs = 0xFF;
+			return a * 1000000;
+		}
+		/* units of 200 baud */
+		a = DIV_ROUND_CLOSEST(bval, 200);
+		*fct = (unsigned char)a;
+		*dvs = (unsigned char)(a >> 8);
+		return a * 200;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(ch343_prescalers); i++) {
+		div = ch343_prescalers[i].div;
+		/* the best divisor is either side of the exact quotient */
+		a = 12000000 / div / bval;
+		for (j = 0; j < 2; j++, a++) {
+			/*
+			 * a divisor of 1 is not used, the same rates come
+			 * from the next faster prescaler and 12 MHz
+			 * undivided is out of spec
+			 */
+			if (a < 2 || a > 0xFF)
+				continue;
+			rate = DIV_ROUND_CLOSEST(12000000, div * a);
+			err = ch343_baud_err(rate, bval);
+			if (err < best_err) {
+				best = rate;
+				best_err = err;
+				*fct = 256 - a;
+				*dvs = ch343_prescalers[i].dvs;
+			}
+		}
+	}
+
+	if (best_err > bval / CH343_BAUD_MAX_ERR)
+		return 0;
+
+	return best;
+}
+
+static int ch343_get(struct ch343 *ch343, unsigned int bval,
+		     unsigned char *fct, unsigned char *dvs,
+		     unsigned int *actual)
+{
+	*actual = ch343_baud_solve(ch343->info, bval, fct, dvs);
+	if (!*actual)
+		return -EINVAL;
+
+	if (ch343->info->flags & CH343_CI_CLOCK)
+		return ch343_clock_set(ch343, bval);
+
+	return 0;
+}
+
+/*
+ * CH343G autobaud. The chip measures the incoming rate and rewrites its
+ * divisor registers, 0x12 holding the prescaler and 0x13 the divisor in
+ * the CMD_C1 encoding. An open port polls them and follows a new rate
+ * into termios so that userspace sees what the chip runs at.
+ */
+static unsigned int ch343_autobaud_decode(u8 dvs, u8 fct)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ch343_prescalers); i++) {
+		if (ch343_prescalers[i].dvs == (dvs & 0x07))
+			return DIV_ROUND_CLOSEST(12000000,
+						 ch343_prescalers[i].div *
+							 (256 - fct));
+	}
+
+	return 0;
+}
+
+/*
+ * Follows a @rate the chip picked on its own into the line settings.
+ * The line coding belongs to set_termios, so it is changed under the
+ * same termios lock the tty core holds around that call. Without a tty
+ * there is nothing to follow into and a later poll tries again.
+ */
+static void ch343_autobaud_follow(struct ch343 *ch343, unsigned int rate)
+{
+	struct tty_struct *tty;
+	bool changed;
+
+	tty = tty_port_tty_get(&ch343->port);
+	if (!tty)
+		return;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0))
+	down_write(&tty->termios_rwsem);
+#else
+	mutex_lock(&tty->termios_mutex);
+#endif
+	changed = rate != ch343->baud_actual;
+	if (changed) {
+		spin_lock_irq(&ch343->write_lock);
+		/* the chip changed the divisor behind the shadow */
+		ch343->shadow[CH343_SH_LINE].valid = false;
+		ch343->termios_valid = false;
+		spin_unlock_irq(&ch343->write_lock);
+
+		ch343->baud_actual = rate;
+		ch343->baud_error_ppm = 0;
+		ch343->line.dwDTERate = rate;
+		ch343_update_writesize(ch343);
+		tty_encode_baud_rate(tty, rate, rate);
+	}
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0))
+	up_write(&tty->termios_rwsem);
+#else
+	mutex_unlock(&tty->termios_mutex);
+#endif
+	tty_kref_put(tty);
+
+	if (changed)
+		dev_dbg(&ch343->control->dev, "autobaud locked at %u baud\n",
+			rate);
+}
+
+/*
+ * Reads the divisor registers and returns the rate they give, called
+ * with the device resumed.
+ */
+static int ch343_autobaud_poll(struct ch343 *ch343)
+{
+	unsigned int rate;
+	u8 div[2];
+	int rv;
+
+	rv = ch343_regs_read(ch343, 0x12, div, 2, true);
+	if (rv < 0)
+		return rv;
+
+	rate = ch343_autobaud_decode(div[0], div[1]);
+	if (!rate)
+		return 0;
+	/* the host's own divisor decodes to exactly baud_actual */
+	if (rate != ch343->baud_actual)
+		ch343_autobaud_follow(ch343, rate);
+	if (rate != ch343->autobaud_rate) {
+		ch343->autobaud_rate = rate;
+		sysfs_notify(&ch343->control->dev.kobj, NULL, "autobaud");
+	}
+
+	return rate;
+}
+
+static void ch343_autobaud_work(struct work_struct *work)
+{
+	struct ch343 *ch343 = container_of(to_delayed_work(work),
+					   struct ch343, autobaud_work);
+	struct ch343_icounts cnow;
+	bool asleep;
+
+	/*
+	 * The read marks the device busy, so polling a quiet line would
+	 * keep it from ever autosuspending. The chip only measures a new
+	 * rate from incoming data, hence a poll without bytes received
+	 * since the last one is skipped, as is one while suspended.
+	 */
+	ch343_icount_read(ch343, &cnow);
+	if (cnow.rx == ch343->autobaud_rx)
+		goto rearm;
+
+	usb_autopm_get_interface_no_resume(ch343->control);
+	spin_lock_irq(&ch343->write_lock);
+	asleep = ch343->susp_count;
+	spin_unlock_irq(&ch343->write_lock);
+	if (!asleep && ch343_autobaud_poll(ch343) >= 0)
+		ch343->autobaud_rx = cnow.rx;
+	usb_autopm_put_interface_no_suspend(ch343->control);
+
+rearm:
+
+	if (!ch343->disconnected)
+		schedule_delayed_work(&ch343->autobaud_work,
+				      msecs_to_jiffies(CH343_AUTOBAUD_POLL));
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0))
+static void ch343_tty_set_termios(struct tty_struct *tty,
+				  const struct ktermios *termios_old)
+#else
+static void ch343_tty_set_termios(struct tty_struct *tty,
+				  struct ktermios *termios_old)
+#endif
+{
+	struct ch343 *ch343 = tty->driver_data;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0))
+	struct ktermios *termios = &tty->termios;
+#else
+	struct ktermios *termios = tty->termios;
+#endif
+	struct usb_ch343_line_coding newline;
+	unsigned int ctrl_clear = 0, ctrl_set = 0, newctrl;
+	bool changed;
+	int r;
+
+	unsigned char dvs = 0;
+	unsigned char reg_count = 0;
+	unsigned char fct = 0;
+	unsigned char reg_value = 0;
+	unsigned short value = 0;
+	unsigned short index = 0;
+	unsigned int baud;
+	unsigned int flags;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0))
+	if (termios_old &&
+	    !tty_termios_hw_change(&tty->termios, termios_old)) {
+#else
+	if (termios_old &&
+	    !tty_termios_hw_change(tty->termios, termios_old)) {
+#endif
+		/* unless the coding was changed behind the shadow */
+		spin_lock_irq(&ch343->write_lock);
+		r = ch343->shadow[CH343_SH_LINE].valid;
+		spin_unlock_irq(&ch343->write_lock);
+		if (r)
+			return;
+	}
+
+	/*
+	 * On open, settings already applied by an earlier open need no
+	 * transfer as long as the device is known to still hold them.
+	 */
+	if (!termios_old && ch343->termios_valid &&
+	    !tty_termios_hw_change(termios, &ch343->termios_applied)) {
+		spin_lock_irq(&ch343->write_lock);
+		r = ch343->shadow[CH343_SH_LINE].valid;
+		if (r)
+			ch343->open_fast++;
+		spin_unlock_irq(&ch343->write_lock);
+		if (r)
+			return;
+	}
+
+	newline.dwDTERate = tty_get_baud_rate(tty);
+	if (newline.dwDTERate == 0)
+		newline.dwDTERate = 9600;
+	r = ch343_get(ch343, newline.dwDTERate, &fct, &dvs, &baud);
+	if (r) {
+		dev_err(&ch343->control->dev,
+			"%s - Bad termios setting, DTERate: %d.\n",
+			__func__, newline.dwDTERate);
+		/* nothing was applied, show what the device still runs */
+		if (termios_old)
+			tty_termios_copy_hw(termios, termios_old);
+		else if (ch343->line.dwDTERate)
+			tty_encode_baud_rate(tty, ch343->line.dwDTERate,
+					     ch343->line.dwDTERate);
+		return;
+	}
+
+	newline.bCharFormat = termios->c_cflag & CSTOPB ? 2 : 1;
+	if (newline.bCharFormat == 2)
+		reg_value |= CH343_L_SB;
+
+	newline.bParityType =
+		termios->c_cflag & PARENB ?
+			(termios->c_cflag & PARODD ? 1 : 2) +
+				(termios->c_cflag & CMSPAR ? 2 : 0) :
+			0;
+
+	switch (newline.bParityType) {
+	case 0x01:
+		reg_value |= CH343_L_P_O;
+		break;
+	case 0x02:
+		reg_value |= CH343_L_P_E;
+		break;
+	case 0x03:
+		reg_value |= CH343_L_P_M;
+		break;
+	case 0x04:
+		reg_value |= CH343_L_P_S;
+		break;
+	default:
+		break;
+	}
+
+	switch (termios->c_cflag & CSIZE) {
+	case CS5:
+		newline.bDataBits = 5;
+		reg_value |= CH343_L_C5;
+		break;
+	case CS6:
+		newline.bDataBits = 6;
+		reg_value |= CH343_L_C6;
+		break;
+	case CS7:
+		newline.bDataBits = 7;
+		reg_value |= CH343_L_C7;
+		break;
+	case CS8:
+	default:
+		newline.bDataBits = 8;
+		reg_value |= CH343_L_C8;
+		break;
+	}
+
+	ch343->clocal = ((termios->c_cflag & CLOCAL) != 0);
+
+	ch343->baud_actual = baud;
+	ch343->baud_error_ppm =
+		div_s64(((s64)baud - newline.dwDTERate) * 1000000,
+			newline.dwDTERate);
+	if (abs(ch343->baud_error_ppm) > CH343_BAUD_WARN_PPM)
+		dev_warn(&ch343->control->dev,
+			 "%u baud runs at %u baud (%d ppm)\n",
+			 newline.dwDTERate, baud, ch343->baud_error_ppm);
+
+	if (C_BAUD(tty) == B0) {
+		baud = ch343->line.dwDTERate;
+		newline.dwDTERate = ch343->line.dwDTERate;
+		ctrl_clear |= CH343_CTO_D | CH343_CTO_R;
+	} else if (termios_old && (termios_old->c_cflag & CBAUD) == B0) {
+		ctrl_set |= CH343_CTO_D | CH343_CTO_R;
+	}
+
+	reg_value |= CH343_L_E_R | CH343_L_E_T;
+	reg_count |= CH343_L_R_CT | CH343_L_R_CL | CH343_L_R_T;
+
+	value |= reg_count;
+	value |= (unsigned short)reg_value << 8;
+
+	index |= 0x00 | dvs;
+	index |= (unsigned short)fct << 8;
+	/* in ordered mode the new coding waits for the data before it */
+	flags = ch343->tx_ordered ? CH343_CR_BARRIER : 0;
+	if (ch343->iface <= 1)
+		ch343_set_state(ch343, CH343_SH_LINE, CMD_C1 + ch343->iface,
+				value, index, flags);
+	else if (ch343->iface <= 3)
+		ch343_set_state(ch343, CH343_SH_LINE,
+				CMD_C1 + 0x10 + (ch343->iface - 2), value,
+				index, flags);
+
+	if (memcmp(&ch343->line, &newline, sizeof newline)) {
+		memcpy(&ch343->line, &newline, sizeof newline);
+		ch343_update_writesize(ch343);
+	}
+
+	if (C_CRTSCTS(tty)) {
+		ctrl_set |= CH343_CTO_A | CH343_CTO_R;
+	} else
+		ctrl_clear |= CH343_CTO_A;
+
+	newctrl = ch343_ctrlout_update(ch343, ctrl_clear, ctrl_set, &changed);
+	if (changed)
+		ch343_set_control(ch343, newctrl);
+
+	/* CLOCAL and CRTSCTS decide whether line changes are consumed */
+	mutex_lock(&ch343->mutex);
+	ch343_status_refresh(ch343);
+	mutex_unlock(&ch343->mutex);
+
+	tty_encode_baud_rate(tty, baud, baud);
+	ch343->termios_applied = *termios;
+	ch343->termios_valid = true;
+}
+
+static const struct tty_port_operations ch343_port_ops = {
+	.dtr_rts = ch343_port_dtr_rts,
+	.shutdown = ch343_port_shutdown,
+	.activate = ch343_port_activate,
+	.destruct = ch343_port_destruct,
+};
+
+static int ch343_proc_show(struct seq_file *m, void *v)
+{
+	struct ch343 *ch343;
+	int i;
+	char tmp[40];
+
+	seq_printf(m, "ch343serinfo:1.0 driver:%s\n", VERSION_DESC);
+	for (i = 0; i < CH343_TTY_MINORS; ++i) {
+		ch343 = ch343_get_by_index(i);
+		if (!ch343)
+			continue;
+		mutex_lock(&ch343->proc_mutex);
+		seq_printf(m, "%d:", i);
+		seq_printf(m, " module:%s", "ch343");
+		seq_printf(m, " name:\"%s\"", "usb_ch343");
+		seq_printf(m, " vendor:%04x product:%04x",
+			   le16_to_cpu(ch343->idVendor),
+			   le16_to_cpu(ch343->idProduct));
+		seq_printf(m, " num_ports:%d", ch343->num_ports);
+		seq_printf(m, " port:%d", ch343->iface);
+		usb_make_path(ch343->dev, tmp, sizeof(tmp));
+		seq_printf(m, " path:%s", tmp);
+		seq_putc(m, '\n');
+		mutex_unlock(&ch343->proc_mutex);
+	}
+	return 0;
+}
+
+static int ch343_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ch343_proc_show, NULL);
+}
+
+static const struct file_operations ch343_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = ch343_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Debugfs: per port control request latency, by request class. Writing
+ * to the file clears the counters.
+ */
+static const char *const ch343_cr_class_names[CH343_CRS_NUM] = {
+	[CH343_CRS_LINE] = "line",   [CH343_CRS_MODEM] = "modem",
+	[CH343_CRS_BREAK] = "break", [CH343_CRS_CHIP] = "chip",
+	[CH343_CRS_CLOCK] = "clock", [CH343_CRS_REG] = "reg",
+	[CH343_CRS_OTHER] = "other",
+};
+
+/* Upper bound in us of the bucket holding the 99th percentile. */
+static u32 ch343_cr_p99(const struct ch343_cr_stats *st)
+{
+	unsigned long want, seen = 0;
+	int i;
+
+	want = st->count - st->count / 100;
+	for (i = 0; i < CH343_CRS_BUCKETS - 1; i++) {
+		seen += st->hist[i];
+		if (seen >= want)
+			return 1U << i;
+	}
+
+	return st->max_us;
+}
+
+static int ch343_cr_stats_show(struct seq_file *m, void *v)
+{
+	struct ch343 *ch343 = m->private;
+	struct ch343_cr_stats st;
+	int i, j;
+
+	seq_printf(m, "%-6s %8s %6s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+		   "class", "count", "errors", "timeouts", "min_us", "avg_us",
+		   "p99_us", "max_us", "wait_avg", "wait_max", "tot_avg",
+		   "tot_max");
+	for (i = 0; i < CH343_CRS_NUM; i++) {
+		spin_lock_irq(&ch343->write_lock);
+		st = ch343->cr_stats[i];
+		spin_unlock_irq(&ch343->write_lock);
+		/* requests timed out in the queue are not in count */
+		if (!st.count && !st.timeouts)
+			continue;
+		seq_printf(m,
+			   "%-6s %8lu %6lu %8lu %8u %8llu %8u %8u %8llu %8u %8llu %8u\n",
+			   ch343_cr_class_names[i], st.count, st.errors,
+			   st.timeouts, st.min_us,
+			   st.count ? div_u64(st.sum_us, st.count) : 0,
+			   st.count ? ch343_cr_p99(&st) : 0, st.max_us,
+			   st.count ? div_u64(st.wait_sum_us, st.count) : 0,
+			   st.wait_max_us,
+			   st.count ? div_u64(st.total_sum_us, st.count) : 0,
+			   st.total_max_us);
+		seq_printf(m, "%-6s", "");
+		for (j = 0; j < CH343_CRS_BUCKETS - 1; j++) {
+			if (st.hist[j])
+				seq_printf(m, " <%u:%u", 1U << j, st.hist[j]);
+		}
+		if (st.hist[j])
+			seq_printf(m, " >=%u:%u", 1U << (j - 1), st.hist[j]);
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+
+static int ch343_cr_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ch343_cr_stats_show, inode->i_private);
+}
+
+static ssize_t ch343_cr_stats_write(struct file *file,
+				    const char __user *buf, size_t count,
+				    loff_t *ppos)
+{
+	struct ch343 *ch343 = ((struct seq_file *)file->private_data)->private;
+
+	spin_lock_irq(&ch343->write_lock);
+	memset(ch343->cr_stats, 0, sizeof(ch343->cr_stats));
+	spin_unlock_irq(&ch343->write_lock);
+
+	return count;
+}
+
+static const struct file_operations ch343_cr_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ch343_cr_stats_open,
+	.read = seq_read,
+	.write = ch343_cr_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Dump of the register cache, "--" for registers not cached. */
+static int ch343_regs_show(struct seq_file *m, void *v)
+{
+	struct ch343 *ch343 = m->private;
+	struct ch343_chip *chip = ch343->chip;
+	int row, col, reg;
+
+	mutex_lock(&chip->reg_mutex);
+	seq_printf(m, "hits:%lu fetches:%lu\n", chip->reg_hits,
+		   chip->reg_fetches);
+	seq_puts(m, "   ");
+	for (col = 0; col < 16; col++)
+		seq_printf(m, " %x ", col);
+	seq_putc(m, '\n');
+	for (row = 0; row < CH343_NREGS; row += 16) {
+		seq_printf(m, "%02x:", row);
+		spin_lock_irq(&chip->reg_lock);
+		for (col = 0; col < 16; col++) {
+			reg = row + col;
+			if (test_bit(reg, chip->reg_valid))
+				seq_printf(m, " %02x", chip->regs[reg]);
+			else
+				seq_puts(m, " --");
+		}
+		spin_unlock_irq(&chip->reg_lock);
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&chip->reg_mutex);
+
+	return 0;
+}
+
+static int ch343_regs_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ch343_regs_show, inode->i_private);
+}
+
+static const struct file_operations ch343_regs_fops = {
+	.owner = THIS_MODULE,
+	.open = ch343_regs_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+#ifdef CH343_TRACE
+static struct static_key_false *const ch343_tr_keys[CH343_TR_NUM] = {
+	[CH343_TR_STATS] = &ch343_tr_stats,
+	[CH343_TR_STAMPS] = &ch343_tr_stamps,
+	[CH343_TR_PAYLOAD] = &ch343_tr_payload,
+	[CH343_TR_HIST] = &ch343_tr_hist,
+};
+
+static const char *const ch343_tr_names[CH343_TR_NUM] = {
+	[CH343_TR_STATS] = "trace_stats",
+	[CH343_TR_STAMPS] = "trace_stamps",
+	[CH343_TR_PAYLOAD] = "trace_payload",
+	[CH343_TR_HIST] = "trace_hist",
+};
+
+static int ch343_tr_get(void *data, u64 *val)
+{
+	*val = static_key_enabled(ch343_tr_keys[(long)data]);
+
+	return 0;
+}
+
+/* A part is switched on before the any branch can reach it. */
+static int ch343_tr_set(void *data, u64 val)
+{
+	struct static_key_false *key = ch343_tr_keys[(long)data];
+
+	mutex_lock(&ch343_tr_mutex);
+	if (val && !static_key_enabled(key)) {
+		static_branch_enable(key);
+		static_branch_inc(&ch343_tr_any);
+	} else if (!val && static_key_enabled(key)) {
+		static_branch_disable(key);
+		static_branch_dec(&ch343_tr_any);
+	}
+	mutex_unlock(&ch343_tr_mutex);
+
+	return 0;
+}
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0))
+DEFINE_DEBUGFS_ATTRIBUTE(ch343_tr_fops, ch343_tr_get, ch343_tr_set, "%llu\n");
+#else
+DEFINE_SIMPLE_ATTRIBUTE(ch343_tr_fops, ch343_tr_get, ch343_tr_set, "%llu\n");
+#endif
+
+static void ch343_trace_hist(struct seq_file *m, const char *dir,
+			     const char *unit, const u32 *hist)
+{
+	int j;
+
+	seq_printf(m, "%-6s %-4s", dir, unit);
+	for (j = 0; j < CH343_TR_BUCKETS - 1; j++) {
+		if (hist[j])
+			seq_printf(m, " <%u:%u", 1U << j, hist[j]);
+	}
+	if (hist[j])
+		seq_printf(m, " >=%u:%u", 1U << (j - 1), hist[j]);
+	seq_putc(m, '\n');
+}
+
+/*
+ * Data path counters. tx times run from submission to completion, rx
+ * and status times are the gaps between completions.
+ */
+static int ch343_trace_show(struct seq_file *m, void *v)
+{
+	struct ch343 *ch343 = m->private;
+	struct ch343_trace *tr;
+	int i;
+
+	/* one consistent view, the completions only wait for the copy */
+	spin_lock_irq(&ch343->trace_lock);
+	seq_printf(m, "%-6s %10s %8s %8s %10s %8s %8s %8s\n", "dir",
+		   "urbs", "errors", "short", "times", "min_us", "avg_us",
+		   "max_us");
+	for (i = 0; i < CH343_TR_DIRS; i++) {
+		tr = &ch343->trace[i];
+		seq_printf(m, "%-6s %10lu %8lu %8lu %10lu %8u %8llu %8u\n",
+			   ch343_tr_dirs[i], tr->urbs, tr->errors, tr->shorts,
+			   tr->count, tr->min_us,
+			   tr->count ? div_u64(tr->sum_us, tr->count) : 0,
+			   tr->max_us);
+	}
+	for (i = 0; i < CH343_TR_DIRS; i++) {
+		tr = &ch343->trace[i];
+		ch343_trace_hist(m, ch343_tr_dirs[i], "size", tr->size_hist);
+		ch343_trace_hist(m, ch343_tr_dirs[i], "us", tr->time_hist);
+	}
+	spin_unlock_irq(&ch343->trace_lock);
+
+	return 0;
+}
+
+static int ch343_trace_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ch343_trace_show, inode->i_private);
+}
+
+static ssize_t ch343_trace_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct ch343 *ch343 = ((struct seq_file *)file->private_data)->private;
+
+	spin_lock_irq(&ch343->trace_lock);
+	memset(ch343->trace, 0, sizeof(ch343->trace));
+	spin_unlock_irq(&ch343->trace_lock);
+
+	return count;
+}
+
+static const struct file_operations ch343_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = ch343_trace_open,
+	.read = seq_read,
+	.write = ch343_trace_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
+static void ch343_debugfs_init(struct ch343 *ch343)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "ttyCH343USB%d", ch343->minor);
+	ch343->debugfs = debugfs_create_dir(name, ch343_debugfs_root);
+	debugfs_create_file("ctrl_stats", 0644, ch343->debugfs, ch343,
+			    &ch343_cr_stats_fops);
+	debugfs_create_file("regs", 0444, ch343->debugfs, ch343,
+			    &ch343_regs_fops);
+#ifdef CH343_TRACE
+	debugfs_create_file("trace", 0644, ch343->debugfs, ch343,
+			    &ch343_trace_fops);
+#endif
+}
+
+/* Module wide switches of the instrumentation parts. */
+static void ch343_debugfs_init_root(void)
+{
+#ifdef CH343_TRACE
+	long i;
+#endif
+
+	ch343_debugfs_root = debugfs_create_dir(KBUILD_MODNAME, NULL);
+#ifdef CH343_TRACE
+	for (i = 0; i < CH343_TR_NUM; i++)
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0))
+		debugfs_create_file_unsafe(ch343_tr_names[i], 0644,
+					   ch343_debugfs_root, (void *)i,
+					   &ch343_tr_fops);
+#else
+		debugfs_create_file(ch343_tr_names[i], 0644,
+				    ch343_debugfs_root, (void *)i,
+				    &ch343_tr_fops);
+#endif
+#endif
+}
+
+/*
+ * Sysfs attributes of the control interface.
+ */
+static ssize_t tx_rate_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%u\n", ch343->tx_rate);
+}
+
+static ssize_t tx_rate_store(struct device *dev,
+			     struct device_attribute *attr, const char *buf,
+			     size_t count)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int val;
+	int rv;
+
+	rv = kstrtouint(buf, 0, &val);
+	if (rv)
+		return rv;
+	rv = ch343_set_tx_rate(ch343, val, ch343->tx_burst);
+
+	return rv ? rv : count;
+}
+static DEVICE_ATTR(tx_rate, 0644, tx_rate_show, tx_rate_store);
+
+static ssize_t tx_burst_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%u\n", ch343->tx_burst);
+}
+
+static ssize_t tx_burst_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int val;
+	int rv;
+
+	rv = kstrtouint(buf, 0, &val);
+	if (rv)
+		return rv;
+	if (!val)
+		return -EINVAL;
+	rv = ch343_set_tx_rate(ch343, ch343->tx_rate, val);
+
+	return rv ? rv : count;
+}
+static DEVICE_ATTR(tx_burst, 0644, tx_burst_show, tx_burst_store);
+
+static ssize_t tx_wakeup_direct_show(struct device *dev,
+				     struct device_attribute *attr,
+				     char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%d\n", ch343->tx_wakeup_direct);
+}
+
+static ssize_t tx_wakeup_direct_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int val;
+	int rv;
+
+	rv = kstrtouint(buf, 0, &val);
+	if (rv)
+		return rv;
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0))
+	if (val)
+		return -EOPNOTSUPP;
+#endif
+	spin_lock_irq(&ch343->write_lock);
+	ch343->tx_wakeup_direct = !!val;
+	spin_unlock_irq(&ch343->write_lock);
+
+	return count;
+}
+static DEVICE_ATTR(tx_wakeup_direct, 0644, tx_wakeup_direct_show,
+		   tx_wakeup_direct_store);
+
+static ssize_t tx_wakeups_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned long direct, deferred;
+
+	spin_lock_irq(&ch343->write_lock);
+	direct = ch343->tx_wakeups_direct;
+	deferred = ch343->tx_wakeups_deferred;
+	spin_unlock_irq(&ch343->write_lock);
+
+	return sprintf(buf, "direct:%lu deferred:%lu\n", direct, deferred);
+}
+static DEVICE_ATTR(tx_wakeups, 0444, tx_wakeups_show, NULL);
+
+static ssize_t tx_urb_size_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%u\n", ch343->writesize);
+}
+
+static ssize_t tx_urb_size_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int val;
+	int rv;
+
+	rv = kstrtouint(buf, 0, &val);
+	if (rv)
+		return rv;
+	if (val > ch343->wb_size)
+		return -EINVAL;
+	ch343->tx_urb_size = val;
+	ch343_update_writesize(ch343);
+
+	return count;
+}
+static DEVICE_ATTR(tx_urb_size, 0644, tx_urb_size_show, tx_urb_size_store);
+
+/*
+ * Status endpoint polling: the interval in microseconds, 0 for what the
+ * endpoint asks for, and the number of status urbs kept in flight. The
+ * interval is a request, status_stats shows the one the host uses.
+ */
+static ssize_t status_interval_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%u\n", ch343->status_interval);
 }
 
-static int ch343_get(struct ch343 *ch343, enum CHIPTYPE chiptype,
-		     unsigned int bval, unsigned char *fct,
-		     unsigned char *dvs)
+static ssize_t status_interval_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
 {
-	unsigned char a;
-	unsigned char b;
-	unsigned long c;
-	char *buffer;
-	int r = 0;
-	const unsigned size = 8;
-	u32 gfreq;
-	u8 change;
-	bool bfirst = false;
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int val;
+	int rv;
 
-	buffer = kmalloc(size, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	rv = kstrtouint(buf, 0, &val);
+	if (rv)
+		return rv;
+	if (val > CH343_STATUS_INTERVAL_MAX)
+		return -EINVAL;
 
-	if ((ch343->chiptype >= CHIP_CH9111L_M0 &&
-	     ch343->chiptype <= CHIP_CH346C_M2) &&
-	    bval >= 2000000) {
-		if ((ch343->chiptype >= CHIP_CH9111L_M0 &&
-		     ch343->chiptype <= CHIP_CH346C_M2) &&
-		    (bval > 13000000)) {
-			*fct = (bval + 500000) / 1000000 - 13;
-			*dvs = 0xFF;
-		} else {
-			*fct = (unsigned char)(bval / 200);
-			*dvs = (unsigned char)((bval / 200) >> 8);
-		}
-	} else if (ch343->chiptype == CHIP_CH347TF && bval > 358400) {
-		*fct = (unsigned char)(bval / 200);
-		*dvs = (unsigned char)((bval / 200) >> 8);
-	} else {
-		switch (bval) {
-		case 6000000:
-		case 4000000:
-		case 2400000:
-		case 921600:
-		case 307200:
-		case 256000:
-			b = 7;
-			c = 12000000;
-			break;
-		default:
-			if (bval > 6000000 / 255) {
-				b = 3;
-				c = 6000000;
-			} else if (bval > 750000 / 255) {
-				b = 2;
-				c = 750000;
-			} else if (bval > 93750 / 255) {
-				b = 1;
-				c = 93750;
-			} else {
-				b = 0;
-				c = 11719;
-			}
+	ch343->status_interval = val;
+	rv = ch343_status_update(ch343);
+
+	return rv ? rv : count;
+}
+static DEVICE_ATTR(status_interval, 0644, status_interval_show,
+		   status_interval_store);
+
+static ssize_t status_urbs_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%u\n", ch343->status_urbs);
+}
+
+static ssize_t status_urbs_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int val;
+	int rv;
+
+	rv = kstrtouint(buf, 0, &val);
+	if (rv)
+		return rv;
+	if (val < 1 || val > CH343_NCTRL)
+		return -EINVAL;
+
+	ch343->status_urbs = val;
+	rv = ch343_status_update(ch343);
+
+	return rv ? rv : count;
+}
+static DEVICE_ATTR(status_urbs, 0644, status_urbs_show, status_urbs_store);
+
+static const char *const ch343_status_polls[] = {
+	[CH343_POLL_ALWAYS] = "always",
+	[CH343_POLL_ON_DEMAND] = "on-demand",
+	[CH343_POLL_NEVER] = "never",
+};
+
+/* When an open port polls modem status: "always", "on-demand", "never". */
+static ssize_t status_poll_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+
+	return sprintf(buf, "%s\n", ch343_status_polls[ch343->status_poll]);
+}
+
+static ssize_t status_poll_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int poll;
+	int rv;
+
+	for (poll = 0; poll < ARRAY_SIZE(ch343_status_polls); poll++)
+		if (sysfs_streq(buf, ch343_status_polls[poll]))
 			break;
-		}
-		a = (unsigned char)(c / bval);
-		if (a == 0 || a == 0xFF)
-			return -EINVAL;
-		if ((c / a - bval) > (bval - c / (a + 1)))
-			a++;
-		a = 256 - a;
+	if (poll == ARRAY_SIZE(ch343_status_polls))
+		return -EINVAL;
 
-		*fct = a;
-		*dvs = b;
-	}
+	mutex_lock(&ch343->mutex);
+	ch343->status_poll = poll;
+	rv = ch343_status_refresh(ch343);
+	mutex_unlock(&ch343->mutex);
+	/* TIOCMIWAIT fails without polling */
+	if (poll == CH343_POLL_NEVER)
+		wake_up_all(&ch343->wioctl);
 
-	if (chiptype == CHIP_CH9114L || chiptype == CHIP_CH9114F ||
-	    chiptype == CHIP_CH9114W || chiptype == CHIP_CH346C_M2) {
-retry:
-		r = ch343_control_in(ch343, CMD_C7, 0x01, 0, buffer, size);
-		if (r <= 0)
-			goto out;
-		else
-			r = 0;
-		gfreq = *(__le32 *)buffer;
-		change = buffer[4];
-
-		if (!change) {
-			if ((gfreq == 120000000 && bval > 1000000 &&
-			     (15000000 % bval)) ||
-			    (gfreq == 96000000 && bval > 1000000 &&
-			     (12000000 % bval)) ||
-			    (gfreq == 80000000 && bval > 1000000 &&
-			     (10000000 % bval))) {
-				if (bfirst) {
-					r = -EINVAL;
-					goto out;
-				} else {
-					bfirst = true;
-					r = ch343_control_out(
-						ch343, CMD_C8,
-						0x02 | (ch343->iface << 8),
-						0x00);
-					if (r) {
-						dev_err(&ch343->control
-								 ->dev,
-							"%s - failed: %d\n",
-							__func__, r);
-						goto out;
-					}
-					r = ch343_control_out(
-						ch343, CMD_C8,
-						0x01 | (ch343->iface << 8),
-						0x00);
-					if (r) {
-						dev_err(&ch343->control
-								 ->dev,
-							"%s - failed: %d\n",
-							__func__, r);
-						goto out;
-					}
-					goto retry;
-				}
-			}
-		}
-	}
+	return rv ? rv : count;
+}
+static DEVICE_ATTR(status_poll, 0644, status_poll_show, status_poll_store);
 
-out:
-	kfree(buffer);
-	return r;
+/*
+ * What the polling policy saved: status polls not made while the port
+ * was open, each of them a transaction on the bus, against the status
+ * urbs that did complete and ran the completion handler. Polls are
+ * counted at the period the host reported on the last submit.
+ */
+static ssize_t status_stats_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int period_us;
+	u64 idle_ns, idle_us;
+	bool running;
+
+	mutex_lock(&ch343->mutex);
+	running = ch343->status_running;
+	idle_ns = ch343->status_idle_ns;
+	if (ch343->status_open && !running)
+		idle_ns += ktime_to_ns(ktime_sub(ktime_get(),
+						 ch343->status_since));
+	mutex_unlock(&ch343->mutex);
+	idle_us = div_u64(idle_ns, NSEC_PER_USEC);
+
+	/* urb intervals count microframes on high speed, frames below */
+	period_us = READ_ONCE(ch343->status_period) *
+		    (ch343->dev->speed >= USB_SPEED_HIGH ? 125 : 1000);
+
+	return sprintf(buf,
+		       "running:%d completions:%lu interval_us:%u idle_ms:%llu polls_saved:%llu\n",
+		       running, ch343->status_completions, period_us,
+		       div_u64(idle_us, USEC_PER_MSEC),
+		       div_u64(idle_us, max(period_us, 1U)));
 }
+static DEVICE_ATTR(status_stats, 0444, status_stats_show, NULL);
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0))
-static void ch343_tty_set_termios(struct tty_struct *tty,
-				  const struct ktermios *termios_old)
-#else
-static void ch343_tty_set_termios(struct tty_struct *tty,
-				  struct ktermios *termios_old)
-#endif
+static ssize_t shadow_stats_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
 {
-	struct ch343 *ch343 = tty->driver_data;
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0))
-	struct ktermios *termios = &tty->termios;
-#else
-	struct ktermios *termios = tty->termios;
-#endif
-	struct usb_ch343_line_coding newline;
-	int newctrl = ch343->ctrlout;
-	int r;
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned long hits, misses, open_fast;
 
-	unsigned char dvs = 0;
-	unsigned char reg_count = 0;
-	unsigned char fct = 0;
-	unsigned char reg_value = 0;
-	unsigned short value = 0;
-	unsigned short index = 0;
+	spin_lock_irq(&ch343->write_lock);
+	hits = ch343->shadow_hits;
+	misses = ch343->shadow_misses;
+	open_fast = ch343->open_fast;
+	spin_unlock_irq(&ch343->write_lock);
 
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0))
-	if (termios_old &&
-	    !tty_termios_hw_change(&tty->termios, termios_old)) {
-#else
-	if (termios_old &&
-	    !tty_termios_hw_change(tty->termios, termios_old)) {
-#endif
-		return;
-	}
+	return sprintf(buf, "hits:%lu misses:%lu open_fast:%lu\n", hits,
+		       misses, open_fast);
+}
+static DEVICE_ATTR(shadow_stats, 0444, shadow_stats_show, NULL);
 
-	newline.dwDTERate = tty_get_baud_rate(tty);
-	if (newline.dwDTERate == 0)
-		newline.dwDTERate = 9600;
-	r = ch343_get(ch343, ch343->chiptype, newline.dwDTERate, &fct,
-		      &dvs);
-	if (r) {
-		dev_err(&ch343->control->dev,
-			"%s - Bad termios setting, DTERate: %d.\n",
-			__func__, newline.dwDTERate);
-		return;
-	}
+static ssize_t ctrl_coalesced_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
 
-	newline.bCharFormat = termios->c_cflag & CSTOPB ? 2 : 1;
-	if (newline.bCharFormat == 2)
-		reg_value |= CH343_L_SB;
+	return sprintf(buf, "%lu\n", ch343->cr_coalesced);
+}
+static DEVICE_ATTR(ctrl_coalesced, 0444, ctrl_coalesced_show, NULL);
 
-	newline.bParityType =
-		termios->c_cflag & PARENB ?
-			(termios->c_cflag & PARODD ? 1 : 2) +
-				(termios->c_cflag & CMSPAR ? 2 : 0) :
-			0;
+static ssize_t tx_ordered_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
 
-	switch (newline.bParityType) {
-	case 0x01:
-		reg_value |= CH343_L_P_O;
-		break;
-	case 0x02:
-		reg_value |= CH343_L_P_E;
-		break;
-	case 0x03:
-		reg_value |= CH343_L_P_M;
-		break;
-	case 0x04:
-		reg_value |= CH343_L_P_S;
-		break;
-	default:
-		break;
-	}
+	return sprintf(buf, "%d\n", ch343->tx_ordered);
+}
 
-	switch (termios->c_cflag & CSIZE) {
-	case CS5:
-		newline.bDataBits = 5;
-		reg_value |= CH343_L_C5;
-		break;
-	case CS6:
-		newline.bDataBits = 6;
-		reg_value |= CH343_L_C6;
-		break;
-	case CS7:
-		newline.bDataBits = 7;
-		reg_value |= CH343_L_C7;
-		break;
-	case CS8:
-	default:
-		newline.bDataBits = 8;
-		reg_value |= CH343_L_C8;
-		break;
-	}
+static ssize_t tx_ordered_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int val;
+	int rv;
 
-	ch343->clocal = ((termios->c_cflag & CLOCAL) != 0);
+	rv = kstrtouint(buf, 0, &val);
+	if (rv)
+		return rv;
+	spin_lock_irq(&ch343->write_lock);
+	ch343->tx_ordered = val != 0;
+	spin_unlock_irq(&ch343->write_lock);
 
-	if (C_BAUD(tty) == B0) {
-		newline.dwDTERate = ch343->line.dwDTERate;
-		newctrl &= ~(CH343_CTO_D | CH343_CTO_R);
-	} else if (termios_old && (termios_old->c_cflag & CBAUD) == B0) {
-		newctrl |= CH343_CTO_D | CH343_CTO_R;
-	}
+	return count;
+}
+static DEVICE_ATTR(tx_ordered, 0644, tx_ordered_show, tx_ordered_store);
 
-	reg_value |= CH343_L_E_R | CH343_L_E_T;
-	reg_count |= CH343_L_R_CT | CH343_L_R_CL | CH343_L_R_T;
+static ssize_t baud_actual_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
 
-	value |= reg_count;
-	value |= (unsigned short)reg_value << 8;
+	return sprintf(buf, "%u\n", ch343->baud_actual);
+}
+static DEVICE_ATTR(baud_actual, 0444, baud_actual_show, NULL);
 
-	index |= 0x00 | dvs;
-	index |= (unsigned short)fct << 8;
-	if (ch343->iface <= 1)
-		ch343_control_out(ch343, CMD_C1 + ch343->iface, value,
-				  index);
-	else if (ch343->iface <= 3)
-		ch343_control_out(ch343,
-				  CMD_C1 + 0x10 + (ch343->iface - 2),
-				  value, index);
+static ssize_t baud_error_ppm_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
 
-	if (memcmp(&ch343->line, &newline, sizeof newline))
-		memcpy(&ch343->line, &newline, sizeof newline);
+	return sprintf(buf, "%d\n", ch343->baud_error_ppm);
+}
+static DEVICE_ATTR(baud_error_ppm, 0444, baud_error_ppm_show, NULL);
 
-	if (C_CRTSCTS(tty)) {
-		newctrl |= CH343_CTO_A | CH343_CTO_R;
-	} else
-		newctrl &= ~CH343_CTO_A;
+/* Bytes moved since probe, 64 bit unlike TIOCGICOUNT. */
+static ssize_t byte_counts_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	struct ch343_icounts cnow;
 
-	if (newctrl != ch343->ctrlout)
-		ch343_set_control(ch343, ch343->ctrlout = newctrl);
+	ch343_icount_read(ch343, &cnow);
 
-	tty_encode_baud_rate(tty, newline.dwDTERate, newline.dwDTERate);
+	return sprintf(buf, "rx:%llu tx:%llu\n",
+		       (unsigned long long)cnow.rx,
+		       (unsigned long long)cnow.tx);
 }
+static DEVICE_ATTR(byte_counts, 0444, byte_counts_show, NULL);
 
-static const struct tty_port_operations ch343_port_ops = {
-	.dtr_rts = ch343_port_dtr_rts,
-	.shutdown = ch343_port_shutdown,
-	.activate = ch343_port_activate,
-	.destruct = ch343_port_destruct,
-};
+/* Rate a CH343G autobaud chip runs at, polled while the port is open. */
+static ssize_t autobaud_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
 
-static int ch343_proc_show(struct seq_file *m, void *v)
+	return sprintf(buf, "%u\n", ch343->autobaud_rate);
+}
+static DEVICE_ATTR(autobaud, 0444, autobaud_show, NULL);
+
+/* Line feeding the PPS source: "dcd", "cts" or "off". */
+static ssize_t pps_show(struct device *dev, struct device_attribute *attr,
+			char *buf)
 {
-	struct ch343 *ch343;
-	int i;
-	char tmp[40];
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
 
-	seq_printf(m, "ch343serinfo:1.0 driver:%s\n", VERSION_DESC);
-	for (i = 0; i < CH343_TTY_MINORS; ++i) {
-		ch343 = ch343_get_by_index(i);
-		if (!ch343)
-			continue;
-		mutex_lock(&ch343->proc_mutex);
-		seq_printf(m, "%d:", i);
-		seq_printf(m, " module:%s", "ch343");
-		seq_printf(m, " name:\"%s\"", "usb_ch343");
-		seq_printf(m, " vendor:%04x product:%04x",
-			   le16_to_cpu(ch343->idVendor),
-			   le16_to_cpu(ch343->idProduct));
-		seq_printf(m, " num_ports:%d", ch343->num_ports);
-		seq_printf(m, " port:%d", ch343->iface);
-		usb_make_path(ch343->dev, tmp, sizeof(tmp));
-		seq_printf(m, " path:%s", tmp);
-		seq_putc(m, '\n');
-		mutex_unlock(&ch343->proc_mutex);
+	switch (ch343->pps_line) {
+	case CH343_CTI_DC:
+		return sprintf(buf, "dcd\n");
+	case CH343_CTI_C:
+		return sprintf(buf, "cts\n");
+	default:
+		return sprintf(buf, "off\n");
 	}
-	return 0;
 }
 
-static int ch343_proc_open(struct inode *inode, struct file *file)
+static ssize_t pps_store(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count)
 {
-	return single_open(file, ch343_proc_show, NULL);
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+	unsigned int line;
+	int rv;
+
+	if (sysfs_streq(buf, "dcd"))
+		line = CH343_CTI_DC;
+	else if (sysfs_streq(buf, "cts"))
+		line = CH343_CTI_C;
+	else if (sysfs_streq(buf, "off"))
+		line = 0;
+	else
+		return -EINVAL;
+
+	mutex_lock(&ch343->mutex);
+	rv = line == ch343->pps_line ? 0 : ch343_pps_set(ch343, line);
+	if (!rv)
+		rv = ch343_status_refresh(ch343);
+	mutex_unlock(&ch343->mutex);
+
+	return rv ? rv : count;
 }
+static DEVICE_ATTR(pps, 0644, pps_show, pps_store);
+
+static struct attribute *ch343_attrs[] = {
+	&dev_attr_tx_rate.attr,
+	&dev_attr_tx_burst.attr,
+	&dev_attr_tx_wakeup_direct.attr,
+	&dev_attr_tx_wakeups.attr,
+	&dev_attr_tx_urb_size.attr,
+	&dev_attr_status_interval.attr,
+	&dev_attr_status_urbs.attr,
+	&dev_attr_status_poll.attr,
+	&dev_attr_status_stats.attr,
+	&dev_attr_shadow_stats.attr,
+	&dev_attr_ctrl_coalesced.attr,
+	&dev_attr_tx_ordered.attr,
+	&dev_attr_baud_actual.attr,
+	&dev_attr_baud_error_ppm.attr,
+	&dev_attr_byte_counts.attr,
+	&dev_attr_autobaud.attr,
+	&dev_attr_pps.attr,
+	NULL,
+};
 
-static const struct file_operations ch343_proc_fops = {
-	.owner = THIS_MODULE,
-	.open = ch343_proc_open,
-	.read = seq_read,
-	.llseek = seq_lseek,
-	.release = single_release,
+/* Attributes only some chips back are left out of the others. */
+static umode_t ch343_attr_visible(struct kobject *kobj,
+				  struct attribute *attr, int n)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct ch343 *ch343 = usb_get_intfdata(to_usb_interface(dev));
+
+	if (attr == &dev_attr_autobaud.attr &&
+	    !(ch343->info->flags & CH343_CI_AUTOBAUD))
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group ch343_attr_group = {
+	.attrs = ch343_attrs,
+	.is_visible = ch343_attr_visible,
 };
 
 static void ch343_write_buffers_free(struct ch343 *ch343)
@@ -1750,7 +5155,7 @@ static void ch343_write_buffers_free(struct ch343 *ch343)
 	struct usb_device *usb_dev = interface_to_usbdev(ch343->control);
 
 	for (wb = &ch343->wb[0], i = 0; i < CH343_NW; i++, wb++)
-		usb_free_coherent(usb_dev, ch343->writesize, wb->buf,
+		usb_free_coherent(usb_dev, ch343->wb_size, wb->buf,
 				  wb->dmah);
 }
 
@@ -1771,14 +5176,14 @@ static int ch343_write_buffers_alloc(struct ch343 *ch343)
 	struct ch343_wb *wb;
 
 	for (wb = &ch343->wb[0], i = 0; i < CH343_NW; i++, wb++) {
-		wb->buf = usb_alloc_coherent(ch343->dev, ch343->writesize,
+		wb->buf = usb_alloc_coherent(ch343->dev, ch343->wb_size,
 					     GFP_KERNEL, &wb->dmah);
 		if (!wb->buf) {
 			while (i != 0) {
 				--i;
 				--wb;
 				usb_free_coherent(ch343->dev,
-						  ch343->writesize,
+						  ch343->wb_size,
 						  wb->buf, wb->dmah);
 			}
 			return -ENOMEM;
@@ -1884,6 +5289,9 @@ static long ch343_ioctl(struct file *file, unsigned int cmd,
 		rv = ch343_control_msg_out(ch343, (u8)arg1, (u8)arg2,
 					   (u16)arg3, (u16)arg4,
 					   (u8 __user *)arg6, (u16)arg5);
+		spin_lock_irq(&ch343->write_lock);
+		ch343_shadow_invalidate(ch343);
+		spin_unlock_irq(&ch343->write_lock);
 		if (rv != (u16)arg5) {
 			rv = -EINVAL;
 			goto out;
@@ -2050,7 +5458,9 @@ next_desc:
 
 	ctrlsize = usb_endpoint_maxp(epctrl);
 	readsize = usb_endpoint_maxp(epread);
-	ch343->writesize = usb_endpoint_maxp(epwrite) * 20;
+	ch343->tx_maxp = usb_endpoint_maxp(epwrite);
+	ch343->writesize = ch343->tx_maxp * CH343_WB_PKTS;
+	ch343->wb_size = ch343->tx_maxp * CH343_WB_MAXPKTS;
 	ch343->control = control_interface;
 	ch343->data = data_interface;
 	ch343->minor = minor;
@@ -2060,10 +5470,27 @@ next_desc:
 	ch343->rx_buflimit = num_rx_buf;
 
 	INIT_WORK(&ch343->work, ch343_softint);
+	INIT_DELAYED_WORK(&ch343->tx_pm_work, ch343_tx_pm_idle);
+	INIT_DELAYED_WORK(&ch343->autobaud_work, ch343_autobaud_work);
+	INIT_DELAYED_WORK(&ch343->status_work, ch343_status_peek_end);
+	ch343_hrtimer_init(&ch343->tx_timer, ch343_tx_timer);
+	ch343_hrtimer_init(&ch343->cr_drain_timer, ch343_cr_drain_timer);
+	ch343_hrtimer_init(&ch343->seq.timer, ch343_seq_timer);
+	init_completion(&ch343->seq.done);
+	mutex_init(&ch343->seq_mutex);
+	ch343_evq_init(&ch343->txts, ch343, sizeof(struct ch343_txts));
+	ch343_evq_init(&ch343->mev, ch343, sizeof(struct ch343_modemev));
+	ch343->tx_burst = ch343->writesize;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0))
+	ch343->tx_wakeup_direct = true;
+#endif
 	init_waitqueue_head(&ch343->wioctl);
+	init_waitqueue_head(&ch343->status_wait);
+	ch343_icount_init(ch343);
 	init_waitqueue_head(&ch343->sendioctl);
 	spin_lock_init(&ch343->write_lock);
 	spin_lock_init(&ch343->read_lock);
+	spin_lock_init(&ch343->trace_lock);
 	mutex_init(&ch343->mutex);
 	mutex_init(&ch343->proc_mutex);
 	ch343->rx_endpoint =
@@ -2073,18 +5500,22 @@ next_desc:
 	init_usb_anchor(&ch343->delayed);
 	ch343->quirks = quirks;
 
-	buf = usb_alloc_coherent(usb_dev, ctrlsize, GFP_KERNEL,
-				 &ch343->ctrl_dma);
-	if (!buf)
-		goto err_put_port;
-	ch343->ctrl_buffer = buf;
+	for (i = 0; i < CH343_NCTRL; i++) {
+		buf = usb_alloc_coherent(usb_dev, ctrlsize, GFP_KERNEL,
+					 &ch343->ctrl_dma[i]);
+		if (!buf)
+			goto err_free_ctrl_buffer;
+		ch343->ctrl_buffer[i] = buf;
+	}
 
 	if (ch343_write_buffers_alloc(ch343) < 0)
 		goto err_free_ctrl_buffer;
 
-	ch343->ctrlurb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!ch343->ctrlurb)
-		goto err_free_write_buffers;
+	for (i = 0; i < CH343_NCTRL; i++) {
+		ch343->ctrlurb[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!ch343->ctrlurb[i])
+			goto err_free_ctrl_urbs;
+	}
 
 	for (i = 0; i < num_rx_buf; i++) {
 		struct ch343_rb *rb = &(ch343->read_buffers[i]);
@@ -2121,26 +5552,42 @@ next_desc:
 			snd->urb, usb_dev,
 			usb_sndbulkpipe(usb_dev,
 					epwrite->bEndpointAddress),
-			NULL, ch343->writesize, ch343_write_bulk, snd);
+			NULL, ch343->wb_size, ch343_write_bulk, snd);
 		snd->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 		snd->instance = ch343;
 	}
 
+	if (ch343_cr_alloc(ch343) < 0)
+		goto err_free_cr;
+
 	usb_set_intfdata(intf, ch343);
 
-	usb_fill_int_urb(ch343->ctrlurb, usb_dev,
-			 usb_rcvintpipe(usb_dev, epctrl->bEndpointAddress),
-			 ch343->ctrl_buffer, ctrlsize, ch343_ctrl_irq,
-			 ch343,
-			 epctrl->bInterval ? epctrl->bInterval : 16);
-	ch343->ctrlurb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	ch343->ctrlurb->transfer_dma = ch343->ctrl_dma;
+	for (i = 0; i < CH343_NCTRL; i++) {
+		usb_fill_int_urb(ch343->ctrlurb[i], usb_dev,
+				 usb_rcvintpipe(usb_dev,
+						epctrl->bEndpointAddress),
+				 ch343->ctrl_buffer[i], ctrlsize,
+				 ch343_ctrl_irq, ch343,
+				 epctrl->bInterval ? epctrl->bInterval : 16);
+		ch343->ctrlurb[i]->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		ch343->ctrlurb[i]->transfer_dma = ch343->ctrl_dma[i];
+	}
+	ch343->ctrl_interval = ch343->ctrlurb[0]->interval;
+	ch343->status_period = ch343->ctrl_interval;
+	ch343->status_urbs = 1;
 
-	dev_info(&intf->dev, "ttyCH343USB%d: usb to uart device\n", minor);
+	ch343->chip = ch343_chip_get(usb_dev);
+	if (!ch343->chip) {
+		rv = -ENOMEM;
+		goto err_free_cr;
+	}
 
 	rv = ch343_configure(ch343);
 	if (rv)
-		goto err_free_write_urbs;
+		goto err_free_cr;
+
+	dev_info(&intf->dev, "ttyCH343USB%d: usb to uart device (%s)\n", minor,
+		 ch343->info->name);
 
 	if (ch343->iosupport && (ch343->iface == 0) &&
 	    (ch343->io_intf == NULL)) {
@@ -2164,23 +5611,35 @@ next_desc:
 	usb_set_intfdata(data_interface, ch343);
 
 	ch343->line.dwDTERate = 9600;
+
+	rv = sysfs_create_group(&control_interface->dev.kobj,
+				&ch343_attr_group);
+	if (rv)
+		goto err_release_data_interface;
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 7, 0))
 	tty_dev = tty_port_register_device(&ch343->port, ch343_tty_driver,
 					   minor, &control_interface->dev);
 	if (IS_ERR(tty_dev)) {
 		rv = PTR_ERR(tty_dev);
-		goto err_release_data_interface;
+		goto err_remove_sysfs;
 	}
 #else
 	tty_register_device(ch343_tty_driver, minor,
 			    &control_interface->dev);
 #endif
 
+	ch343_debugfs_init(ch343);
+
 	return 0;
 
+err_remove_sysfs:
+	sysfs_remove_group(&control_interface->dev.kobj, &ch343_attr_group);
 err_release_data_interface:
 	usb_set_intfdata(data_interface, NULL);
 	usb_driver_release_interface(&ch343_driver, data_interface);
+err_free_cr:
+	ch343_cr_free(ch343);
 err_free_write_urbs:
 	for (i = 0; i < CH343_NW; i++)
 		usb_free_urb(ch343->wb[i].urb);
@@ -2188,13 +5647,17 @@ err_free_read_urbs:
 	for (i = 0; i < num_rx_buf; i++)
 		usb_free_urb(ch343->read_urbs[i]);
 	ch343_read_buffers_free(ch343);
-	usb_free_urb(ch343->ctrlurb);
-err_free_write_buffers:
+err_free_ctrl_urbs:
+	for (i = 0; i < CH343_NCTRL; i++)
+		usb_free_urb(ch343->ctrlurb[i]);
 	ch343_write_buffers_free(ch343);
 err_free_ctrl_buffer:
-	usb_free_coherent(usb_dev, ctrlsize, ch343->ctrl_buffer,
-			  ch343->ctrl_dma);
-err_put_port:
+	for (i = 0; i < CH343_NCTRL; i++) {
+		if (ch343->ctrl_buffer[i])
+			usb_free_coherent(usb_dev, ctrlsize,
+					  ch343->ctrl_buffer[i],
+					  ch343->ctrl_dma[i]);
+	}
 	tty_port_put(&ch343->port);
 
 	return rv;
@@ -2218,10 +5681,9 @@ static void stop_data_traffic(struct ch343 *ch343)
 			break;
 		wb = urb->context;
 		wb->use = 0;
-		usb_autopm_put_interface_async(ch343->control);
 	}
 
-	usb_kill_urb(ch343->ctrlurb);
+	ch343_status_kill(ch343);
 	for (i = 0; i < CH343_NW; i++)
 		usb_kill_urb(ch343->wb[i].urb);
 	for (i = 0; i < ch343->rx_buflimit; i++)
@@ -2231,9 +5693,10 @@ static void stop_data_traffic(struct ch343 *ch343)
 	mutex_lock(&ch343->mutex);
 	if (!ch343->disconnected) {
 		usb_autopm_get_interface(ch343->control);
-		ch343_set_control(ch343, ch343->ctrlout = 0);
+		ch343_set_control(ch343,
+				  ch343_ctrlout_update(ch343, ~0U, 0, NULL));
 
-		usb_kill_urb(ch343->ctrlurb);
+		ch343_status_kill(ch343);
 		for (i = 0; i < CH343_NW; i++)
 			usb_kill_urb(ch343->wb[i].urb);
 		for (i = 0; i < ch343->rx_buflimit; i++)
@@ -2257,6 +5720,10 @@ static void ch343_disconnect(struct usb_interface *intf)
 	if (!ch343)
 		return;
 
+	sysfs_remove_group(&ch343->control->dev.kobj, &ch343_attr_group);
+	debugfs_remove_recursive(ch343->debugfs);
+	ch343->debugfs = NULL;
+
 	/* give back minor */
 	if (ch343->iosupport && (ch343->iface == 0) &&
 	    (ch343->io_intf != NULL)) {
@@ -2265,9 +5732,16 @@ static void ch343_disconnect(struct usb_interface *intf)
 	}
 
 	mutex_lock(&ch343->mutex);
+	/* no control request is taken or queued after this */
+	spin_lock_irq(&ch343->write_lock);
 	ch343->disconnected = true;
+	spin_unlock_irq(&ch343->write_lock);
 	wake_up_all(&ch343->wioctl);
+	wake_up_all(&ch343->status_wait);
 	wake_up_all(&ch343->sendioctl);
+	wake_up_all(&ch343->txts.wait);
+	wake_up_all(&ch343->mev.wait);
+	wake_up_all(&ch343->cr_wait);
 	usb_set_intfdata(ch343->control, NULL);
 	usb_set_intfdata(ch343->data, NULL);
 	mutex_unlock(&ch343->mutex);
@@ -2279,16 +5753,26 @@ static void ch343_disconnect(struct usb_interface *intf)
 	}
 
 	stop_data_traffic(ch343);
+	ch343_pps_set(ch343, 0);
+	ch343_cr_flush(ch343);
+	hrtimer_cancel(&ch343->cr_drain_timer);
+	hrtimer_cancel(&ch343->seq.timer);
+	hrtimer_cancel(&ch343->tx_timer);
+	/* the timers may have queued a wakeup, which must not outlive us */
+	cancel_work_sync(&ch343->work);
+	ch343_tx_pm_release(ch343);
 	tty_unregister_device(ch343_tty_driver, ch343->minor);
 
-	usb_free_urb(ch343->ctrlurb);
+	for (i = 0; i < CH343_NCTRL; i++)
+		usb_free_urb(ch343->ctrlurb[i]);
 	for (i = 0; i < CH343_NW; i++)
 		usb_free_urb(ch343->wb[i].urb);
 	for (i = 0; i < ch343->rx_buflimit; i++)
 		usb_free_urb(ch343->read_urbs[i]);
 	ch343_write_buffers_free(ch343);
-	usb_free_coherent(usb_dev, ch343->ctrlsize, ch343->ctrl_buffer,
-			  ch343->ctrl_dma);
+	for (i = 0; i < CH343_NCTRL; i++)
+		usb_free_coherent(usb_dev, ch343->ctrlsize,
+				  ch343->ctrl_buffer[i], ch343->ctrl_dma[i]);
 	ch343_read_buffers_free(ch343);
 
 	usb_driver_release_interface(
@@ -2306,11 +5790,15 @@ static int ch343_suspend(struct usb_interface *intf, pm_message_t message)
 
 	spin_lock_irq(&ch343->write_lock);
 	if (PMSG_IS_AUTO(message)) {
-		if (ch343->transmitting) {
+		if (ch343->transmitting || ch343->cr_active ||
+		    !list_empty(&ch343->cr_queue)) {
 			spin_unlock_irq(&ch343->write_lock);
 			return -EBUSY;
 		}
 	}
+	/* the device may lose power while the system sleeps */
+	if (!PMSG_IS_AUTO(message))
+		ch343_shadow_invalidate(ch343);
 	cnt = ch343->susp_count++;
 	spin_unlock_irq(&ch343->write_lock);
 	if (cnt)
@@ -2330,12 +5818,15 @@ static int ch343_resume(struct usb_interface *intf)
 	if (--ch343->susp_count)
 		goto out;
 
+	ch343_cr_kick(ch343);
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0))
 	if (tty_port_initialized(&ch343->port)) {
 #else
 	if (test_bit(ASYNCB_INITIALIZED, &ch343->port.flags)) {
 #endif
-		rv = usb_submit_urb(ch343->ctrlurb, GFP_ATOMIC);
+		if (ch343->status_running)
+			rv = ch343_status_submit(ch343, GFP_ATOMIC);
 		for (;;) {
 			urb = usb_get_from_anchor(&ch343->delayed);
 			if (!urb)
@@ -2356,6 +5847,10 @@ static int ch343_reset_resume(struct usb_interface *intf)
 {
 	struct ch343 *ch343 = usb_get_intfdata(intf);
 
+	spin_lock_irq(&ch343->write_lock);
+	ch343_shadow_invalidate(ch343);
+	spin_unlock_irq(&ch343->write_lock);
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0))
 	if (tty_port_initialized(&ch343->port))
 #else
@@ -2502,8 +5997,11 @@ static int __init ch343_init(void)
 		return retval;
 	}
 
+	ch343_debugfs_init_root();
+
 	retval = usb_register(&ch343_driver);
 	if (retval) {
+		debugfs_remove_recursive(ch343_debugfs_root);
 		tty_unregister_driver(ch343_tty_driver);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0))
 		tty_driver_kref_put(ch343_tty_driver);
@@ -2522,6 +6020,7 @@ static int __init ch343_init(void)
 static void __exit ch343_exit(void)
 {
 	usb_deregister(&ch343_driver);
+	debugfs_remove_recursive(ch343_debugfs_root);
 	tty_unregister_driver(ch343_tty_driver);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0))
 	tty_driver_kref_put(ch343_tty_driver);
@@ -17,6 +17,79 @@
 #define DEFAULT_BAUD_RATE 9600
 #define DEFAULT_TIMEOUT 2000
 
+/*
+ * Transmit pacing limits, rate in bytes per second, burst in bytes
+ */
+#define CH343_TX_RATE_MAX 16000000
+#define CH343_TX_BURST_MAX (1 << 20)
+
+/*
+ * Idle time in ms before the write path drops its runtime PM reference
+ */
+#define CH343_TX_PM_IDLE 50
+
+/*
+ * Write URB sizing: buffers hold up to CH343_WB_MAXPKTS packets, the fill
+ * size targets CH343_TX_TARGET_MS of data on the wire at the line rate
+ */
+#define CH343_WB_PKTS 20
+#define CH343_WB_MAXPKTS 64
+#define CH343_TX_TARGET_MS 20
+
+/*
+ * Depth in records of the transmit timestamp queue
+ */
+#define CH343_TXTS_LEN 256
+
+/*
+ * Depth in records of the modem event queue
+ */
+#define CH343_MEV_LEN 1024
+
+/*
+ * Baud divisor limits: rates off by more than 1/CH343_BAUD_MAX_ERR are
+ * refused, an error above CH343_BAUD_WARN_PPM is logged
+ */
+#define CH343_BAUD_MAX_ERR 20
+#define CH343_BAUD_WARN_PPM 20000
+
+/*
+ * Interval in ms at which an open CH343G autobaud port polls the rate
+ * the chip has locked onto
+ */
+#define CH343_AUTOBAUD_POLL 250
+
+/*
+ * Time in ms on-demand status polling stays on after TIOCMGET or
+ * TIOCGICOUNT, and the longest such a call waits for a first report
+ */
+#define CH343_STATUS_WINDOW 1000
+#define CH343_STATUS_SETTLE 20
+
+/*
+ * Ports sharing a system clock, and the highest rate every clock serves
+ */
+#define CH343_CLK_PORTS 4
+#define CH343_CLK_FREE_MAX 1000000
+
+/*
+ * Vendor register file reached with CMD_R/CMD_W, and the largest range
+ * moved by one register ioctl
+ */
+#define CH343_NREGS 256
+#define CH343_REGIO_MAX 32
+
+/* ch343_regio flags */
+#define CH343_REGIO_NOCACHE 0x01 /* read from the device, not the cache */
+
+struct ch343_regio {
+	__u8 start; /* first register */
+	__u8 count; /* number of registers, at most CH343_REGIO_MAX */
+	__u8 flags;
+	__u8 reserved;
+	__u8 data[CH343_REGIO_MAX];
+};
+
 /*
  * CMSPAR, some architectures can't have space and mark parity.
  */
@@ -93,8 +166,23 @@
 #define CH343_N_AB 0x10
 
 #define CH343_NW 2
+#define CH343_NCTRL 2 /* status urbs, up to this many in flight */
+#define CH343_STATUS_INTERVAL_MAX 255000 /* longest status poll in us */
+
+/* When the status urbs of an open port run */
+enum {
+	CH343_POLL_ALWAYS, /* for as long as the port is open */
+	CH343_POLL_ON_DEMAND, /* while something consumes line changes */
+	CH343_POLL_NEVER,
+};
 #define CH343_NR 2
 
+/*
+ * Control requests of a port and the data stage size of each
+ */
+#define CH343_NCR 16
+#define CH343_CR_BUFSIZE 16
+
 #define IOID 0x13572468
 
 struct ch343_wb {
@@ -102,10 +190,321 @@ struct ch343_wb {
 	dma_addr_t dmah;
 	int len;
 	int use;
+	u64 drain_ns; /* line time of buf at the coding it was queued at */
+	u32 ticket; /* timestamp ticket, 0 if not stamped */
+	u32 seq_gen; /* sequence run of this urb, 0 if none */
+	ktime_t submit; /* submission time of a stamped urb */
+	bool stamped; /* submit is set */
+	struct urb *urb;
+	struct ch343 *instance;
+};
+
+/*
+ * Slots of the device state shadow, each mirrors the last value
+ * queued for one kind of vendor request.
+ */
+enum {
+	CH343_SH_LINE, /* CMD_C1 line coding and divisor */
+	CH343_SH_MODEM, /* CMD_C2 modem outputs */
+	CH343_SH_BREAK, /* CMD_C4 break state */
+	CH343_SH_PORT, /* CMD_C8 port enable on CH9114/CH346C */
+	CH343_SH_NUM,
+};
+
+struct ch343_shadow {
+	bool valid;
+	u8 request;
+	u16 value;
+	u16 index;
+};
+
+/*
+ * State of one chip, shared by the ports of a device
+ */
+struct ch343_chip {
+	struct list_head list; /* on ch343_chips */
+	struct kref kref;
+	struct usb_device *dev;
+
+	/* system clock of a CH9114/CH346C_M2 */
+	struct mutex clk_lock;
+	bool clk_valid; /* gfreq is known and the device will keep it */
+	u32 gfreq; /* system clock in Hz */
+	u8 change; /* device is free to switch clocks */
+	unsigned int rate[CH343_CLK_PORTS]; /* rates of open ports */
+
+	/* CMD_R/CMD_W register cache */
+	struct mutex reg_mutex; /* serializes register access */
+	spinlock_t reg_lock; /* protects the fields below */
+	unsigned long reg_gen; /* bumped whenever the cache is dropped */
+	DECLARE_BITMAP(reg_valid, CH343_NREGS);
+	u8 regs[CH343_NREGS];
+	unsigned long reg_hits; /* registers served from the cache */
+	unsigned long reg_fetches; /* CMD_R transfers */
+};
+
+/*
+ * Control request classes kept apart in the latency statistics
+ */
+enum {
+	CH343_CRS_LINE, /* CMD_C1 line coding */
+	CH343_CRS_MODEM, /* CMD_C2 modem outputs */
+	CH343_CRS_BREAK, /* CMD_C4 break */
+	CH343_CRS_CHIP, /* CMD_C6 chip query */
+	CH343_CRS_CLOCK, /* CMD_C7/CMD_C8 clock and port enable */
+	CH343_CRS_REG, /* CMD_R/CMD_W registers */
+	CH343_CRS_OTHER,
+	CH343_CRS_NUM,
+};
+
+/* bucket i counts latencies below 2^i us, the last one everything above */
+#define CH343_CRS_BUCKETS 24
+
+/*
+ * Latency of the requests that reached the bus. The bus time runs from
+ * urb submission to completion and feeds the histogram, the wait from
+ * the caller asking for a request, a free one included, to submission,
+ * the total from there to completion.
+ */
+struct ch343_cr_stats {
+	unsigned long count;
+	unsigned long errors;
+	unsigned long timeouts;
+	u64 sum_us;
+	u32 min_us;
+	u32 max_us;
+	u64 wait_sum_us;
+	u32 wait_max_us;
+	u64 total_sum_us;
+	u32 total_max_us;
+	u32 hist[CH343_CRS_BUCKETS];
+};
+
+/*
+ * Data path instrumentation. Each part sits behind a static branch
+ * toggled in debugfs, so a disabled one costs a NOP in the completion
+ * handlers.
+ */
+enum {
+	CH343_TR_STATS, /* urb counts, errors and short transfers */
+	CH343_TR_STAMPS, /* tx latency, rx and status arrival gaps */
+	CH343_TR_PAYLOAD, /* hex dump of urb data to the kernel log */
+	CH343_TR_HIST, /* histograms of urb sizes and of the times */
+	CH343_TR_NUM,
+};
+
+enum {
+	CH343_TR_RX,
+	CH343_TR_TX,
+	CH343_TR_STATUS,
+	CH343_TR_DIRS,
+};
+
+/* bucket i counts values below 2^i, the last one everything above */
+#define CH343_TR_BUCKETS 20
+
+/* updated from the completion handler of one endpoint, under trace_lock */
+struct ch343_trace {
+	unsigned long urbs;
+	unsigned long errors;
+	unsigned long shorts; /* tx urbs that sent less than queued */
+	unsigned long count; /* times measured */
+	u64 sum_us;
+	u32 min_us;
+	u32 max_us;
+	ktime_t last; /* previous rx or status completion */
+	u32 size_hist[CH343_TR_BUCKETS];
+	u32 time_hist[CH343_TR_BUCKETS]; /* in us */
+};
+
+/* ch343_set_state() flags */
+#define CH343_CR_WAIT 0x01 /* sleep until the device has applied it */
+#define CH343_CR_BARRIER 0x02 /* hold until earlier tx data has drained */
+
+struct ch343_cr;
+
+/* called with write_lock held, must not sleep */
+typedef void (*ch343_cr_complete_t)(struct ch343 *ch343,
+				    struct ch343_cr *cr);
+
+/*
+ * Vendor control request executed asynchronously on endpoint 0.
+ */
+struct ch343_cr {
+	struct list_head list; /* on cr_free or cr_queue */
 	struct urb *urb;
+	struct usb_ctrlrequest *dr; /* setup packet */
+	u8 *buf; /* data stage */
+	int status; /* bytes transferred or negative error */
+	bool waited; /* a sleeping caller owns the request */
+	bool pm; /* holds an async autopm reference */
+	bool timedout; /* killed by a waiter that gave up */
+	bool barrier; /* waits for the tx path to drain */
+	bool elided; /* satisfied by the shadow, never sent */
+	ktime_t requested; /* time the caller asked for a request */
+	ktime_t submit; /* time the urb was submitted */
+	struct completion done;
+	ch343_cr_complete_t complete;
+	void *context;
+	struct ch343_shadow *shadow; /* slot the request writes, if any */
+	struct ch343 *instance;
+};
+
+/*
+ * Record queue read through an anonymous file descriptor.
+ */
+struct ch343_evq {
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	void *buf;
+	unsigned int recsize; /* size of one record */
+	unsigned int len; /* capacity in records, a power of two */
+	unsigned int head;
+	unsigned int tail;
+	bool open;
 	struct ch343 *instance;
 };
 
+/*
+ * Transmit completion timestamp, one per write urb. Tickets are never
+ * 0, lost counts the records dropped on a full queue just before this
+ * one.
+ */
+struct ch343_txts {
+	__u32 ticket; /* sequence number of the write urb */
+	__u32 bytes; /* bytes transferred */
+	__u64 submit_ns; /* CLOCK_MONOTONIC at submission */
+	__u64 complete_ns; /* CLOCK_MONOTONIC at completion */
+	__s32 status; /* urb completion status */
+	__u32 lost;
+};
+
+/*
+ * Modem event, one per status packet that changed an input line or
+ * reported a receive error. seq counts the events produced while the
+ * queue is open, lost those dropped on a full queue just before this
+ * one, so a reader can account for every edge.
+ */
+#define CH343_MEV_BREAK 0x01
+#define CH343_MEV_OVERRUN 0x02
+#define CH343_MEV_PARITY 0x04
+#define CH343_MEV_FRAME 0x08
+
+struct ch343_modemev {
+	__u64 time_ns; /* CLOCK_MONOTONIC at the status urb completion */
+	__u32 seq;
+	__u32 lost;
+	__u16 old_lines; /* TIOCM_CTS, TIOCM_DSR, TIOCM_RI and TIOCM_CD */
+	__u16 new_lines;
+	__u32 errors; /* CH343_MEV_* */
+};
+
+/*
+ * Modem line sequence run by IOCTL_CMD_MODEMSEQ. Each step sets DTR/RTS
+ * and holds them for delay_us before the next one. On return done_ns of
+ * each step is when the device acknowledged it, counted from the start
+ * of the sequence, and total_ns the duration including the last hold.
+ * A step asking for the lines already set sends nothing, its done_ns is
+ * when it was skipped and CH343_SEQ_ELIDED is set in flags.
+ */
+#define CH343_SEQ_MAX 32
+#define CH343_SEQ_DELAY_MAX 10000000 /* longest hold, in us */
+#define CH343_SEQ_ELIDED 0x01
+
+struct ch343_seqstep {
+	__u32 lines; /* TIOCM_DTR and TIOCM_RTS to assert */
+	__u32 delay_us; /* hold time before the next step */
+	__u64 done_ns; /* out */
+	__u32 flags; /* out: CH343_SEQ_* */
+	__u32 reserved;
+};
+
+struct ch343_modemseq {
+	__u32 nsteps;
+	__u32 reserved;
+	__u64 total_ns; /* out */
+	struct ch343_seqstep steps[CH343_SEQ_MAX];
+};
+
+/*
+ * Break framed transmit run by IOCTL_CMD_BREAKFRAME: a break of break_us,
+ * a mark of mab_us, then the payload as a single bulk transfer, as used
+ * by DMX512 and LIN. The break starts once earlier data has left the
+ * urbs, or the chip fifo as well while tx_ordered is set. The *_ns
+ * fields are filled in like done_ns of a modem line sequence, flags
+ * tells which break request the device state made unnecessary, and
+ * whether a failed run had to end a break it left on.
+ */
+#define CH343_FRAME_MAX 1024
+#define CH343_BF_BREAK_ELIDED 0x01
+#define CH343_BF_MARK_ELIDED 0x02
+#define CH343_BF_BREAK_CLEARED 0x04
+
+struct ch343_breakframe {
+	__u32 break_us;
+	__u32 mab_us;
+	__u32 len; /* payload bytes */
+	__u32 flags; /* out: CH343_BF_* */
+	__u64 break_ns; /* out: break acknowledged */
+	__u64 mark_ns; /* out: break end acknowledged */
+	__u64 done_ns; /* out: payload urb completed */
+	__u8 data[CH343_FRAME_MAX];
+};
+
+/* Operations of a sequence. */
+enum {
+	CH343_SEQ_MODEM, /* arg is the ctrlout line mask */
+	CH343_SEQ_BREAK, /* arg is the break state */
+	CH343_SEQ_DATA, /* send seq.data */
+};
+
+struct ch343_seqop {
+	u8 type;
+	u32 arg;
+	u32 delay_us; /* hold time before the next op */
+	u64 done_ns;
+	bool elided; /* nothing was sent for it */
+};
+
+/*
+ * State of a running sequence, ops are issued from seq.timer and
+ * advanced from the completion of their control request or urb.
+ */
+struct ch343_seq {
+	struct hrtimer timer;
+	struct completion done;
+	bool active; /* cleared on completion or abort */
+	bool hold_tx; /* tty writes wait for the sequence */
+	int status;
+	u32 gen; /* tags the requests of one run, never 0 */
+	unsigned int index; /* op issued next, or being issued */
+	unsigned int nops;
+	ktime_t start;
+	const u8 *data;
+	unsigned int len;
+	struct ch343_seqop ops[CH343_SEQ_MAX];
+};
+
+/* Values of the line event and byte counters. */
+struct ch343_icounts {
+	u32 cts, dsr, rng, dcd;
+	u32 frame, parity, overrun, brk, buf_overrun;
+	u64 rx, tx;
+};
+
+/*
+ * Counters are updated without locks, each group from a single
+ * completion handler: line events from the status urbs under seq, rx
+ * from the read urbs and tx from the write urbs under their
+ * u64_stats_sync. ch343_icount_read() returns a consistent copy.
+ */
+struct ch343_icount {
+	seqcount_t seq;
+	struct u64_stats_sync rx_sync;
+	struct u64_stats_sync tx_sync;
+	struct ch343_icounts c;
+};
+
 struct ch343_rb {
 	int size;
 	unsigned char *base;
@@ -114,6 +513,11 @@ struct ch343_rb {
 	struct ch343 *instance;
 };
 
+struct ch343_txrate {
+	__u32 rate; /* bytes per second, 0 disables pacing */
+	__u32 burst; /* token bucket depth in bytes */
+};
+
 struct usb_ch343_line_coding {
 	__u32 dwDTERate;
 	__u8 bCharFormat;
@@ -160,14 +564,48 @@ enum CHIPTYPE {
 	CHIP_CH346C_M2,
 };
 
+/* Feature flags of struct ch343_chipinfo */
+#define CH343_CI_STATUS_PORT 0x0001 /* status type in byte 1, not byte 0 */
+#define CH343_CI_STATUS_PORT0 0x0002 /* ...and only byte 0 == 0 is valid */
+#define CH343_CI_STATUS_CTS 0x0004 /* modem status reports only CTS */
+#define CH343_CI_BREAK_PORT 0x0008 /* break set per port by interface */
+#define CH343_CI_BAUD_MHZ 0x0010 /* whole MHz encoding above 13 Mbaud */
+#define CH343_CI_CLOCK 0x0020 /* shared, switchable reference clock */
+#define CH343_CI_PORT_EN 0x0040 /* ports enabled with CMD_C8 on open */
+#define CH343_CI_AUTOBAUD 0x0080 /* divisor set by autobaud detection */
+
+/*
+ * Per chip descriptor, resolved once by ch343_configure() so hot paths
+ * test a flag instead of a list of chip types.
+ */
+struct ch343_chipinfo {
+	const char *name;
+	unsigned int flags;
+	u32 baud_fine; /* lowest rate using the 200 baud unit encoding */
+};
+
 struct ch343 {
 	struct usb_device *dev; /* the corresponding usb device */
 	struct usb_interface *control; /* control interface */
 	struct usb_interface *data; /* data interface */
 	struct tty_port port; /* our tty port data */
-	struct urb *ctrlurb; /* urbs */
-	u8 *ctrl_buffer; /* buffers of urbs */
-	dma_addr_t ctrl_dma; /* dma handles of buffers */
+	struct urb *ctrlurb[CH343_NCTRL]; /* urbs */
+	u8 *ctrl_buffer[CH343_NCTRL]; /* buffers of urbs */
+	dma_addr_t ctrl_dma[CH343_NCTRL]; /* dma handles of buffers */
+	unsigned int status_urbs; /* status urbs submitted while open */
+	unsigned int status_interval; /* poll interval in us, 0 for default */
+	int ctrl_interval; /* urb interval the endpoint asks for */
+	int status_period; /* urb interval the host left after submit */
+	unsigned int status_poll; /* CH343_POLL_* policy */
+	bool status_open; /* port is open, status urbs may run */
+	bool status_running; /* status urbs are submitted */
+	unsigned int status_waiters; /* callers blocked in TIOCMIWAIT */
+	bool status_peek; /* TIOCMGET/TIOCGICOUNT poll window is open */
+	unsigned long status_peek_last; /* jiffies of the last such call */
+	struct delayed_work status_work; /* closes the poll window */
+	unsigned long status_completions; /* status urbs completed */
+	ktime_t status_since; /* last change of status_running */
+	u64 status_idle_ns; /* time open without polling */
 	struct ch343_wb wb[CH343_NW];
 	unsigned long read_urbs_free;
 	struct urb *read_urbs[CH343_NR];
@@ -177,19 +615,32 @@ struct ch343 {
 	spinlock_t read_lock;
 	int write_used; /* number of non-empty write buffers */
 	int transmitting;
+	bool tx_pm_held; /* write path holds an autopm reference */
+	unsigned long tx_last; /* jiffies when the tx queue went idle */
+	struct delayed_work tx_pm_work; /* drops tx_pm_held when idle */
 	spinlock_t write_lock;
 	struct mutex mutex;
 	struct mutex proc_mutex;
 	bool disconnected;
 	struct usb_ch343_line_coding line; /* baudrate, data format */
+	struct ktermios termios_applied; /* settings set_termios last sent */
+	bool termios_valid; /* termios_applied is set */
+	unsigned long open_fast; /* opens that sent no line coding */
 	struct work_struct work; /* used for line discipline waking up */
+	bool tx_wakeup_direct; /* wake writers from the write completion */
+	unsigned long tx_wakeups_direct; /* wakeups done in the completion */
+	unsigned long tx_wakeups_deferred; /* wakeups deferred to work */
 	unsigned int ctrlin; /* input lines (CTS, DSR, DCD, RI) */
+	bool ctrlin_known; /* ctrlin came from the running status urbs */
+	wait_queue_head_t status_wait; /* for ctrlin_known */
 	unsigned int ctrlout; /* output control lines (DTR, RTS) */
-	struct async_icount iocount; /* counters for control line changes */
-	struct async_icount oldcount; /* for comparison of counter */
+	struct ch343_icount icount; /* line event and byte counters */
 	wait_queue_head_t wioctl; /* for ioctl */
 	wait_queue_head_t sendioctl; /* for ioctl */
-	unsigned int writesize; /* max packet size*/
+	unsigned int writesize; /* current write urb fill size */
+	unsigned int wb_size; /* allocated size of write buffers */
+	unsigned int tx_maxp; /* bulk out max packet size */
+	unsigned int tx_urb_size; /* user override of writesize, 0 if auto */
 	unsigned int readsize, ctrlsize; /* buffer sizes for freeing */
 	unsigned int minor; /* ch343 minor number */
 	unsigned char clocal; /* termios CLOCAL */
@@ -202,12 +653,52 @@ struct ch343 {
 	struct usb_interface *io_intf;
 	struct kref kref;
 	enum CHIPTYPE chiptype;
+	const struct ch343_chipinfo *info; /* descriptor of chiptype */
 	bool iosupport;
 	u16 idVendor;
 	u16 idProduct;
 	u8 gpio5dir;
 	u32 io_id;
-	u32 gfreq;
+	struct ch343_chip *chip; /* state shared with sibling ports */
+	unsigned int baud_actual; /* rate the divisor really gives */
+	int baud_error_ppm; /* baud_actual against the requested rate */
+	struct delayed_work autobaud_work; /* polls the detected rate */
+	unsigned int autobaud_rate; /* rate the divisor registers give */
+	u64 autobaud_rx; /* received bytes at the last poll */
+#if IS_ENABLED(CONFIG_PPS)
+	struct pps_device *pps; /* PPS source, NULL if off */
+#endif
+	unsigned int pps_line; /* CH343_CTI_* line feeding pps, 0 if off */
+	u32 tx_rate; /* paced bytes per second, 0 if unpaced */
+	u32 tx_burst; /* token bucket depth in bytes */
+	u64 tx_tokens; /* available bytes scaled by NSEC_PER_SEC */
+	ktime_t tx_stamp; /* time of last token refill */
+	struct hrtimer tx_timer; /* wakes a writer starved of tokens */
+	u32 tx_ticket; /* last transmit timestamp ticket */
+	u32 txts_lost; /* timestamps dropped since the last queued */
+	struct ch343_evq txts; /* transmit timestamp records */
+	struct ch343_evq mev; /* modem event records */
+	u32 mev_seq; /* modem events produced */
+	u32 mev_lost; /* modem events dropped since the last queued */
+	struct ch343_cr cr[CH343_NCR]; /* control requests */
+	struct list_head cr_free; /* idle control requests */
+	struct list_head cr_queue; /* control requests waiting to run */
+	struct ch343_cr *cr_active; /* control request on the bus */
+	wait_queue_head_t cr_wait; /* for a free control request */
+	struct ch343_shadow shadow[CH343_SH_NUM]; /* last queued state */
+	unsigned long shadow_hits; /* requests elided by the shadow */
+	unsigned long shadow_misses; /* requests sent to the device */
+	unsigned long cr_coalesced; /* modem updates merged into the queue */
+	bool tx_ordered; /* line coding changes wait for queued tx data */
+	unsigned int cr_barriers; /* barrier requests not yet completed */
+	ktime_t tx_drained; /* when the chip fifo empties after tx idles */
+	struct hrtimer cr_drain_timer; /* restarts a held barrier */
+	struct mutex seq_mutex; /* one sequence at a time */
+	struct ch343_seq seq; /* protected by write_lock */
+	struct ch343_cr_stats cr_stats[CH343_CRS_NUM]; /* request latency */
+	struct dentry *debugfs; /* per port debugfs directory */
+	spinlock_t trace_lock; /* trace updates against reads and reset */
+	struct ch343_trace trace[CH343_TR_DIRS]; /* data path */
 };
 
 #define CDC_DATA_INTERFACE_TYPE 0x0a